@@ -1,7 +1,12 @@
 # -*- coding: utf-8 -*-
 
-from flask import Blueprint, current_app, jsonify, request
+from flask import Blueprint, current_app, jsonify, request, json
 from datetime import datetime
+from collections import OrderedDict
+from io import BytesIO
+from pymongo import UpdateOne
+import gzip
+import hashlib
 
 from ..extensions import mongo
 from ..utils import dt2ts
@@ -10,6 +15,11 @@ api = Blueprint('api', __name__, url_prefix='/api')
 
 DURATION_MAP = {'s': 1, 'm': 60, 'h': 3600, 'd': 86400}
 
+# Recent pools served per (tag, proto, source), by revision. Deltas are computed
+# against them, an unknown revision (evicted, restarted or another worker) gets all.
+SNAPSHOTS = {}
+SNAPSHOT_HISTORY = 8
+
 @api.route("/")
 def index():
     return ""
@@ -87,7 +97,53 @@ def proxy(tag, proto):
             continue
     
         records.append(r)
-    return jsonify(records)
+
+    # rps sends the revision it holds, old clients want the plain list
+    if "since" not in request.args:
+        return jsonify(records)
+
+    return delta(request.args.get("since"), (tag, proto, source), records)
+
+def upstream_key(r):
+    return "%s:%s" %(r.get("host"), r.get("port"))
+
+def delta(since, key, records):
+    current = dict((upstream_key(r), r) for r in records)
+    revision = hashlib.sha1(json.dumps(sorted(current.items()), sort_keys=True)).hexdigest()
+
+    if since == revision:
+        return "", 304
+
+    history = SNAPSHOTS.setdefault(key, OrderedDict())
+    history.pop(revision, None)
+    history[revision] = current
+    while len(history) > SNAPSHOT_HISTORY:
+        history.popitem(last=False)
+
+    old = history.get(since) if since else None
+    if old is None:
+        body = {"revision": revision, "full": True, "upstreams": records, "removed": []}
+    else:
+        upserts = [r for k, r in current.items() if old.get(k) != r]
+        removed = [{"host": r.get("host"), "port": r.get("port"), "proto": r.get("proto")}
+                for k, r in old.items() if k not in current]
+        body = {"revision": revision, "full": False, "upstreams": upserts, "removed": removed}
+
+    return compress(jsonify(body))
+
+def compress(resp):
+    if "gzip" not in request.headers.get("Accept-Encoding", ""):
+        return resp
+
+    buf = BytesIO()
+    f = gzip.GzipFile(mode="wb", fileobj=buf)
+    f.write(resp.get_data())
+    f.close()
+
+    resp.set_data(buf.getvalue())
+    resp.headers["Content-Encoding"] = "gzip"
+    resp.headers["Vary"] = "Accept-Encoding"
+    return resp
 
 @api.route("/<tag>/stats/<any('socks5', 'http', 'http_tunnel'):proto>/", methods=["GET", "POST"])
 def stats(tag, proto):
@@ -120,6 +176,39 @@ def stats(tag, proto):
         return jsonify(records)
 
 
+# Stored as the form endpoint stores them, strings or None, whichever wrote last
+def form_value(v):
+    if v is None:
+        return None
+    return u"%s" % v
+
+# rps posts upstreams changed since their last commit, as json arrays in batches
+@api.route("/<tag>/stats/<any('socks5', 'http', 'http_tunnel'):proto>/bulk", methods=["POST"])
+def stats_bulk(tag, proto):
+    collection = mongo.db.u_stats
+
+    records = request.get_json(silent=True)
+    if not isinstance(records, list):
+        return jsonify(status="BAD", error="Body should be json array"), 400
+
+    now = datetime.now()
+    fields = ("uname", "passwd", "enable", "success", "failure", "count", 
+            "timewheel", "insert_date", "expire_date", "source")
+    requests = []
+    for r in records:
+        if not isinstance(r, dict) or r.get("host") is None or r.get("port") is None:
+            continue
+
+        filter = {"tag":tag, "proto":proto, "host": r["host"], "port": form_value(r["port"])}
+        set = dict((k, form_value(r.get(k, None))) for k in fields)
+        set["last_commit"] = now
+        requests.append(UpdateOne(filter, {"$set":set}, upsert=True))
+
+    if requests:
+        collection.bulk_write(requests, ordered=False)
+
+    return jsonify(status="ok", n=len(requests))
+
 
 @api.route("/proxy/<any('ban', 'unban'):action>/<host>", methods=["POST"])
 def ban(action, host):
@@ -0,0 +1,375 @@
+#include "core.h"
+#include "api.h"
+#include "util.h"
+
+#include <uv.h>
+#include <curl/curl.h>
+
+struct api_sock {
+    uv_poll_t       poll;
+    curl_socket_t   fd;
+    struct api      *api;
+    struct api_sock *prev;
+    struct api_sock *next;
+};
+
+struct api_req {
+    struct api      *api;
+    struct api_req  *prev;
+    struct api_req  *next;
+    CURL            *easy;
+    struct curl_slist *headers;
+    api_cb          cb;
+    void            *data;
+    char            *buf;
+    size_t          len;
+    char            error[CURL_ERROR_SIZE];
+};
+
+static void api_check(struct api *a);
+
+/* In flight requests and watched sockets are linked into the api, deinit drops the rest */
+#define API_LINK(_head, _e) do {                                    \
+    (_e)->prev = NULL;                                              \
+    (_e)->next = (_head);                                           \
+    if ((_head) != NULL) {                                          \
+        (_head)->prev = (_e);                                       \
+    }                                                               \
+    (_head) = (_e);                                                 \
+} while (0)
+
+#define API_UNLINK(_head, _e) do {                                  \
+    if ((_e)->prev != NULL) {                                       \
+        (_e)->prev->next = (_e)->next;                              \
+    } else {                                                        \
+        (_head) = (_e)->next;                                       \
+    }                                                               \
+    if ((_e)->next != NULL) {                                       \
+        (_e)->next->prev = (_e)->prev;                              \
+    }                                                               \
+} while (0)
+
+static void
+api_on_sock_close(uv_handle_t *handle) {
+    rps_free(handle->data);
+}
+
+static void
+api_on_poll(uv_poll_t *handle, int status, int events) {
+    struct api_sock *as;
+    int flags, running;
+
+    as = handle->data;
+
+    flags = 0;
+    if (status < 0) {
+        flags = CURL_CSELECT_ERR;
+    } else {
+        if (events & UV_READABLE) {
+            flags |= CURL_CSELECT_IN;
+        }
+        if (events & UV_WRITABLE) {
+            flags |= CURL_CSELECT_OUT;
+        }
+    }
+
+    curl_multi_socket_action(as->api->multi, as->fd, flags, &running);
+
+    api_check(as->api);
+}
+
+static int
+api_on_socket(CURL *easy, curl_socket_t fd, int action, void *userp, void *socketp) {
+    struct api *a;
+    struct api_sock *as;
+    int events;
+
+    UNUSED(easy);
+
+    a = userp;
+    as = socketp;
+
+    if (action == CURL_POLL_REMOVE) {
+        if (as != NULL) {
+            uv_poll_stop(&as->poll);
+            curl_multi_assign(a->multi, fd, NULL);
+            API_UNLINK(a->socks, as);
+            uv_close((uv_handle_t *)&as->poll, api_on_sock_close);
+        }
+        return 0;
+    }
+
+    if (as == NULL) {
+        as = rps_alloc(sizeof(*as));
+        if (as == NULL) {
+            return -1;
+        }
+
+        if (uv_poll_init_socket(&a->loop, &as->poll, fd) != 0) {
+            rps_free(as);
+            return -1;
+        }
+
+        as->poll.data = as;
+        as->fd = fd;
+        as->api = a;
+        API_LINK(a->socks, as);
+        curl_multi_assign(a->multi, fd, as);
+    }
+
+    events = 0;
+    if (action != CURL_POLL_OUT) {
+        events |= UV_READABLE;
+    }
+    if (action != CURL_POLL_IN) {
+        events |= UV_WRITABLE;
+    }
+
+    uv_poll_start(&as->poll, events, api_on_poll);
+
+    return 0;
+}
+
+static void
+api_on_timeout(uv_timer_t *handle) {
+    struct api *a;
+    int running;
+
+    a = handle->data;
+
+    curl_multi_socket_action(a->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+
+    api_check(a);
+}
+
+static int
+api_on_timer(CURLM *multi, long timeout_ms, void *userp) {
+    struct api *a;
+
+    UNUSED(multi);
+
+    a = userp;
+
+    if (timeout_ms < 0) {
+        uv_timer_stop(&a->timer);
+    } else {
+        /* 0 asks to act at once, but not from inside curl */
+        uv_timer_start(&a->timer, api_on_timeout, timeout_ms > 0 ? timeout_ms : 1, 0);
+    }
+
+    return 0;
+}
+
+static size_t
+api_on_write(void *contents, size_t size, size_t nmemb, void *userp) {
+    struct api_req *req;
+    size_t realsize;
+    char *buf;
+
+    req = userp;
+    realsize = size * nmemb;
+
+    buf = rps_realloc(req->buf, req->len + realsize + 1);
+    if (buf == NULL) {
+        log_error("read api response error, not enough memory");
+        return 0;
+    }
+
+    req->buf = buf;
+    memcpy(&req->buf[req->len], contents, realsize);
+    req->len += realsize;
+    req->buf[req->len] = '\0';
+
+    return realsize;
+}
+
+static void
+api_req_free(struct api_req *req) {
+    if (req->easy != NULL) {
+        curl_easy_cleanup(req->easy);
+    }
+    if (req->headers != NULL) {
+        curl_slist_free_all(req->headers);
+    }
+    if (req->buf != NULL) {
+        rps_free(req->buf);
+    }
+    rps_free(req);
+}
+
+/* Hand finished requests to their callbacks */
+static void
+api_check(struct api *a) {
+    CURLMsg *msg;
+    struct api_req *req;
+    char *url;
+    long code;
+    int pending;
+    rps_status_t status;
+
+    while ((msg = curl_multi_info_read(a->multi, &pending)) != NULL) {
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
+        }
+
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_EFFECTIVE_URL, &url);
+
+        status = RPS_OK;
+        code = 0;
+
+        if (msg->data.result != CURLE_OK) {
+            log_error("request '%s' trigger error. %s", url,
+                    req->error[0] ? req->error : curl_easy_strerror(msg->data.result));
+            status = RPS_ERROR;
+        } else {
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+            if (code >= 400) {
+                log_error("request '%s' trigger error. status code %ld", url, code);
+                status = RPS_ERROR;
+            }
+        }
+
+        curl_multi_remove_handle(a->multi, msg->easy_handle);
+        API_UNLINK(a->reqs, req);
+        a->n--;
+
+        req->cb(req->data, status, code, req->buf != NULL ? req->buf : "", req->len);
+
+        api_req_free(req);
+    }
+}
+
+static int
+api_request(struct api *a, const char *url, const char *type, const char *body, 
+        uint32_t timeout, api_cb cb, void *data) {
+    struct api_req *req;
+    struct curl_slist *headers;
+    char header[128];
+    CURL *easy;
+
+    req = rps_alloc(sizeof(*req));
+    if (req == NULL) {
+        return RPS_ENOMEM;
+    }
+
+    req->api = a;
+    req->cb = cb;
+    req->data = data;
+    req->headers = NULL;
+    req->buf = NULL;
+    req->len = 0;
+    req->error[0] = '\0';
+
+    easy = curl_easy_init();
+    req->easy = easy;
+    if (easy == NULL) {
+        api_req_free(req);
+        return RPS_ENOMEM;
+    }
+
+    curl_easy_setopt(easy, CURLOPT_URL, url);
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, api_on_write);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, (void *)req);
+    curl_easy_setopt(easy, CURLOPT_ERRORBUFFER, req->error);
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, (void *)req);
+    curl_easy_setopt(easy, CURLOPT_USERAGENT, RPS_CURL_UA);
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+    /* any encoding curl decodes, gzip mostly */
+    curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT, (long)timeout);
+
+    if (type != NULL) {
+        snprintf(header, sizeof(header), "Content-Type: %s", type);
+        headers = curl_slist_append(NULL, header);
+        if (headers == NULL) {
+            api_req_free(req);
+            return RPS_ENOMEM;
+        }
+        req->headers = headers;
+        curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+    }
+
+    if (body != NULL) {
+        /* curl keeps its own copy, callers may reuse the body */
+        curl_easy_setopt(easy, CURLOPT_COPYPOSTFIELDS, body);
+    }
+
+    if (curl_multi_add_handle(a->multi, easy) != CURLM_OK) {
+        api_req_free(req);
+        return RPS_ERROR;
+    }
+
+    API_LINK(a->reqs, req);
+    a->n++;
+
+    return RPS_OK;
+}
+
+int
+api_get(struct api *a, const char *url, uint32_t timeout, api_cb cb, void *data) {
+    return api_request(a, url, NULL, NULL, timeout, cb, data);
+}
+
+int
+api_post(struct api *a, const char *url, const char *type, const char *body, 
+        uint32_t timeout, api_cb cb, void *data) {
+    return api_request(a, url, type, body, timeout, cb, data);
+}
+
+int
+api_init(struct api *a) {
+    if (uv_loop_init(&a->loop) != 0) {
+        return RPS_ERROR;
+    }
+
+    a->multi = curl_multi_init();
+    if (a->multi == NULL) {
+        uv_loop_close(&a->loop);
+        return RPS_ENOMEM;
+    }
+
+    uv_timer_init(&a->loop, &a->timer);
+    a->timer.data = a;
+    a->n = 0;
+    a->reqs = NULL;
+    a->socks = NULL;
+
+    curl_multi_setopt(a->multi, CURLMOPT_SOCKETFUNCTION, api_on_socket);
+    curl_multi_setopt(a->multi, CURLMOPT_SOCKETDATA, a);
+    curl_multi_setopt(a->multi, CURLMOPT_TIMERFUNCTION, api_on_timer);
+    curl_multi_setopt(a->multi, CURLMOPT_TIMERDATA, a);
+    curl_multi_setopt(a->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)API_MAX_HOST_CONNECTIONS);
+    curl_multi_setopt(a->multi, CURLMOPT_MAXCONNECTS, (long)API_MAX_CONNECTIONS);
+
+    return RPS_OK;
+}
+
+/* Requests still in flight are dropped without calling back */
+void
+api_deinit(struct api *a) {
+    struct api_req *req;
+    struct api_sock *as;
+
+    while ((req = a->reqs) != NULL) {
+        curl_multi_remove_handle(a->multi, req->easy);
+        API_UNLINK(a->reqs, req);
+        a->n--;
+        api_req_free(req);
+    }
+
+    curl_multi_cleanup(a->multi);
+    a->multi = NULL;
+
+    /* sockets of connections curl kept for reuse */
+    while ((as = a->socks) != NULL) {
+        API_UNLINK(a->socks, as);
+        uv_poll_stop(&as->poll);
+        uv_close((uv_handle_t *)&as->poll, api_on_sock_close);
+    }
+
+    uv_close((uv_handle_t *)&a->timer, NULL);
+    uv_run(&a->loop, UV_RUN_DEFAULT);
+    uv_loop_close(&a->loop);
+}
@@ -0,0 +1,49 @@
+/*
+ * Asynchronous web api client of the control plane, curl multi driven by a libuv loop.
+ *
+ * Requests run in parallel, each bounded by its own timeout. Curl sockets are watched
+ * with uv_poll and its timeouts with a uv_timer, callbacks run on the loop's thread.
+ */
+
+#ifndef _RPS_API_H
+#define _RPS_API_H
+
+#include <uv.h>
+#include <stdint.h>
+#include <curl/curl.h>
+
+#define API_MAX_HOST_CONNECTIONS    16  /* to one host at once, more requests queue */
+#define API_MAX_CONNECTIONS         32  /* idle ones kept alive for reuse */
+
+#define API_NOT_MODIFIED            304
+
+/* 
+ * status is RPS_OK or RPS_ERROR, code the http status or 0 without response.
+ * resp is NUL terminated and decompressed, valid during the callback only.
+ */
+typedef void (*api_cb)(void *data, int status, long code, const char *resp, size_t len);
+
+struct api_req;
+struct api_sock;
+
+struct api {
+    uv_loop_t       loop;
+    uv_timer_t      timer;      /* curl's timeout */
+    CURLM           *multi;
+    uint32_t        n;          /* requests in flight */
+    struct api_req  *reqs;      /* in flight */
+    struct api_sock *socks;     /* watched for curl */
+};
+
+int api_init(struct api *a);
+void api_deinit(struct api *a);
+
+/* timeout in seconds, 0 means none. Errors return without calling back */
+int api_get(struct api *a, const char *url, uint32_t timeout,
+        api_cb cb, void *data);
+
+/* type is the body's content type, NULL for a form */
+int api_post(struct api *a, const char *url, const char *type, const char *body,
+        uint32_t timeout, api_cb cb, void *data);
+
+#endif
@@ -87,6 +87,10 @@ config_server_init(struct config_server *server) {
     server->port = 0;
     string_init(&server->username);
     string_init(&server->password);
+    server->workers = SERVER_DEFAULT_WORKERS;
+    string_init(&server->cpu_affinity);
+    server->reuseport_cbpf = 0;
+    string_init(&server->tunnel_engine);
 }
 
 static void
@@ -95,6 +99,8 @@ config_server_deinit(struct config_server *server) {
     string_deinit(&server->listen);
     string_deinit(&server->username);
     string_deinit(&server->password);
+    string_deinit(&server->cpu_affinity);
+    string_deinit(&server->tunnel_engine);
 }
 
 
@@ -107,6 +113,9 @@ config_servers_init(struct config_servers *servers) {
 
     servers->rtimeout = 0;
     servers->ftimeout = 0;
+    string_init(&servers->accept);
+    servers->workers = SERVER_DEFAULT_WORKERS;
+    string_init(&servers->cpu_affinity);
 
     return RPS_OK;
 }
@@ -117,6 +126,8 @@ config_servers_deinit(struct config_servers *servers) {
         config_server_deinit((struct config_server *)array_pop(servers->ss));
     }
     array_destroy(servers->ss);
+    string_deinit(&servers->accept);
+    string_deinit(&servers->cpu_affinity);
 }
 
 static void
@@ -136,11 +147,19 @@ config_upstreams_init(struct config_upstreams *upstreams) {
     upstreams->maxreconn = UPSTREAM_DEFAULT_MAXRECONN;
     upstreams->maxretry = UPSTREAM_DEFAULT_MAXRETRY;
     string_init(&upstreams->schedule);
+    string_init(&upstreams->chash_key);
+    string_init(&upstreams->health_target);
     upstreams->hybrid = UPSTREAM_DEFAULT_BYBRID;
     upstreams->mr1m = UPSTREAM_DEFAULT_MR1M;
     upstreams->mr1h = UPSTREAM_DEFAULT_MR1H;
     upstreams->mr1d = UPSTREAM_DEFAULT_MR1D;
+    upstreams->rate = UPSTREAM_DEFAULT_RATE;
+    upstreams->burst = UPSTREAM_DEFAULT_BURST;
     upstreams->max_fail_rate = UPSTREAM_DEFAULT_MAX_FIAL_RATE;
+    upstreams->max_inflight = UPSTREAM_DEFAULT_MAX_INFLIGHT;
+    upstreams->health_check = UPSTREAM_DEFAULT_HEALTH_CHECK;
+    upstreams->health_timeout = UPSTREAM_DEFAULT_HEALTH_TIMEOUT * 1000;
+    upstreams->health_concurrency = UPSTREAM_DEFAULT_HEALTH_CONCURRENCY;
 
 #ifdef SOCKS4_PROXY_SUPPORT
     upstreams->pools = array_create(2, sizeof(struct config_upstream));
@@ -150,6 +169,8 @@ config_upstreams_init(struct config_upstreams *upstreams) {
 
     if (upstreams->pools == NULL) {
         string_deinit(&upstreams->schedule);
+        string_deinit(&upstreams->chash_key);
+        string_deinit(&upstreams->health_target);
         return RPS_ENOMEM;
     }
 
@@ -159,6 +180,8 @@ config_upstreams_init(struct config_upstreams *upstreams) {
 static void
 config_upstreams_deinit(struct config_upstreams *upstreams) {
     string_deinit(&upstreams->schedule);
+    string_deinit(&upstreams->chash_key);
+    string_deinit(&upstreams->health_target);
     while (array_n(upstreams->pools)) {
         config_upstream_deinit((struct config_upstream *)array_pop(upstreams->pools));
     }
@@ -235,6 +258,17 @@ config_handler_map(struct config *cfg, rps_str_t *key, rps_str_t *val, rps_str_t
             cfg->servers.rtimeout = (atoi((char *)val->data)) * 1000;
         } else if (rps_strcmp(key, "ftimeout") == 0){
             cfg->servers.ftimeout = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "accept") == 0) {
+            status = string_copy(&cfg->servers.accept, val);
+        } else if (rps_strcmp(key, "workers") == 0) {
+            cfg->servers.workers = atoi((char *)val->data);
+            if (cfg->servers.workers < 1 || cfg->servers.workers > SERVER_MAX_WORKERS) {
+                status = RPS_ERROR;
+            }
+        } else if (rps_strcmp(key, "cpu_affinity") == 0) {
+            if (!string_empty(val)) {
+                status = string_copy(&cfg->servers.cpu_affinity, val);
+            }
         } else {
             status = RPS_ERROR;
         }
@@ -250,6 +284,24 @@ config_handler_map(struct config *cfg, rps_str_t *key, rps_str_t *val, rps_str_t
             status = string_copy(&server->username, val);
         } else if (rps_strcmp(key, "password") == 0) {
             status = string_copy(&server->password, val);
+        } else if (rps_strcmp(key, "workers") == 0) {
+            server->workers = atoi((char *)val->data);
+            if (server->workers < 1 || server->workers > SERVER_MAX_WORKERS) {
+                status = RPS_ERROR;
+            }
+        } else if (rps_strcmp(key, "cpu_affinity") == 0) {
+            if (!string_empty(val)) {
+                status = string_copy(&server->cpu_affinity, val);
+            }
+        } else if (rps_strcmp(key, "reuseport_cbpf") == 0) {
+            _bool = config_parse_bool(val);
+            if (_bool < 0) {
+                status  = RPS_ERROR;
+            } else {
+                server->reuseport_cbpf = (unsigned)_bool;
+            }
+        } else if (rps_strcmp(key, "tunnel_engine") == 0) {
+            status = string_copy(&server->tunnel_engine, val);
         } else {
             status = RPS_ERROR;
         }
@@ -277,8 +329,24 @@ config_handler_map(struct config *cfg, rps_str_t *key, rps_str_t *val, rps_str_t
             cfg->upstreams.mr1h = atoi((char *)val->data);
         } else if (rps_strcmp(key, "mr1d") == 0) { 
             cfg->upstreams.mr1d = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "rate") == 0) {
+            cfg->upstreams.rate = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "burst") == 0) {
+            cfg->upstreams.burst = atoi((char *)val->data);
         } else if (rps_strcmp(key, "max_fail_rate") == 0) { 
             cfg->upstreams.max_fail_rate = atof((char *)val->data);
+        } else if (rps_strcmp(key, "max_inflight") == 0) {
+            cfg->upstreams.max_inflight = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "chash_key") == 0) {
+            status = string_copy(&cfg->upstreams.chash_key, val);
+        } else if (rps_strcmp(key, "health_check") == 0) {
+            cfg->upstreams.health_check = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "health_target") == 0) {
+            status = string_copy(&cfg->upstreams.health_target, val);
+        } else if (rps_strcmp(key, "health_timeout") == 0) {
+            cfg->upstreams.health_timeout = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "health_concurrency") == 0) {
+            cfg->upstreams.health_concurrency = atoi((char *)val->data);
         } else {
             status = RPS_ERROR;
         }
@@ -651,6 +719,10 @@ config_dump_server(void *data) {
     log_debug("\t   port: %d", server->port);
     log_debug("\t   username: %s", server->username.data);
     log_debug("\t   password: %s", server->password.data);
+    log_debug("\t   workers: %d", server->workers);
+    log_debug("\t   cpu_affinity: %s", server->cpu_affinity.data);
+    log_debug("\t   reuseport_cbpf: %d", server->reuseport_cbpf);
+    log_debug("\t   tunnel_engine: %s", server->tunnel_engine.data);
     log_debug("");
 }
 
@@ -671,6 +743,9 @@ config_dump(struct config *cfg) {
     log_debug("[servers]");
     log_debug("\t rtimeout: %d", cfg->servers.rtimeout);
     log_debug("\t ftimeout: %d", cfg->servers.ftimeout);
+    log_debug("\t accept: %s", cfg->servers.accept.data);
+    log_debug("\t workers: %d", cfg->servers.workers);
+    log_debug("\t cpu_affinity: %s", cfg->servers.cpu_affinity.data);
     log_debug("");
     array_foreach(cfg->servers.ss, config_dump_server);
 
@@ -684,7 +759,15 @@ config_dump(struct config *cfg) {
     log_debug("\t mr1m: %d", cfg->upstreams.mr1m);
     log_debug("\t mr1h: %d", cfg->upstreams.mr1h);
     log_debug("\t mr1d: %d", cfg->upstreams.mr1d);
+    log_debug("\t rate: %d", cfg->upstreams.rate);
+    log_debug("\t burst: %d", cfg->upstreams.burst);
     log_debug("\t max_fail_rate: %.2f", cfg->upstreams.max_fail_rate);
+    log_debug("\t max_inflight: %d", cfg->upstreams.max_inflight);
+    log_debug("\t chash_key: %s", cfg->upstreams.chash_key.data);
+    log_debug("\t health_check: %d", cfg->upstreams.health_check/1000);
+    log_debug("\t health_target: %s", cfg->upstreams.health_target.data);
+    log_debug("\t health_timeout: %d", cfg->upstreams.health_timeout/1000);
+    log_debug("\t health_concurrency: %d", cfg->upstreams.health_concurrency);
     log_debug("");
     array_foreach(cfg->upstreams.pools, config_dump_upstream);
 
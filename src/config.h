@@ -18,11 +18,23 @@
 #define UPSTREAM_DEFAULT_MR1H   0
 #define UPSTREAM_DEFAULT_MR1D   0
 #define UPSTREAM_DEFAULT_MAX_FIAL_RATE  0.0
+#define UPSTREAM_DEFAULT_MAX_INFLIGHT   0
+#define UPSTREAM_DEFAULT_RATE   0
+#define UPSTREAM_DEFAULT_BURST  0
+#define UPSTREAM_DEFAULT_HEALTH_CHECK       0
+#define UPSTREAM_DEFAULT_HEALTH_TIMEOUT     10
+#define UPSTREAM_DEFAULT_HEALTH_CONCURRENCY 64
+
+#define SERVER_DEFAULT_WORKERS  1
+#define SERVER_MAX_WORKERS      64
 
 struct config_servers {
     rps_array_t     *ss;
     uint32_t        rtimeout;
     uint32_t        ftimeout;
+    rps_str_t       accept;         /* reuseport or handoff */
+    uint32_t        workers;        /* handoff worker pool size */
+    rps_str_t       cpu_affinity;   /* handoff worker pool affinity */
 };
 
 struct config_server {
@@ -31,6 +43,10 @@ struct config_server {
     uint16_t        port;
     rps_str_t       username;
     rps_str_t       password;
+    uint32_t        workers;
+    rps_str_t       cpu_affinity;
+    unsigned        reuseport_cbpf:1;
+    rps_str_t       tunnel_engine;
 };
 
 struct config_upstream {
@@ -47,7 +63,15 @@ struct config_upstreams {
     uint32_t        mr1m;
     uint32_t        mr1h;
     uint32_t        mr1d;
+    uint32_t        rate;
+    uint32_t        burst;
     float           max_fail_rate;
+    uint32_t        max_inflight;
+    rps_str_t       chash_key;
+    uint32_t        health_check;   /* ms between probe rounds, 0 disables */
+    rps_str_t       health_target;  /* host:port */
+    uint32_t        health_timeout;
+    uint32_t        health_concurrency;
     rps_array_t     *pools;
 };
 
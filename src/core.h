@@ -13,10 +13,29 @@
 #define RPS_EUPSTREAM   -3
 #define RPS_EQUEUE   -4
 
+/* Reads start at READ_BUF_SIZE, established reads double the size each time they fill 
+ * the buffer up to READ_BUF_MAX, and halve it when they use a quarter or less.
+ */
 #define READ_BUF_SIZE 2048 //2k
-#define WRITE_BUF_SIZE 65536 //64k
+#define READ_BUF_MAX  65536 //64k
+#define WRITE_BUF_SIZE 16384 //16k, max chunk size borrowed for a single write
 #define WRITE_UV_BUF_SIZE   20
 
+/* Established reads up to this size are copied behind the peer's pending output,
+ * larger ones lend the read chunk to the peer's write queue without copying.
+ */
+#define WRITE_COPY_MAX  512
+
+/* Stop reading from the producer while the peer has more than high watermark bytes 
+ * waiting to be written, resume after drained below low watermark. 
+ */
+#define WRITE_HIGH_WATERMARK    131072 //128k, two reads of READ_BUF_MAX
+#define WRITE_LOW_WATERMARK     32768 //32k
+
+/* Client usernames may carry a sticky session as '<username>-session-<token>' */
+#define SESSION_TOKEN_PREFIX    "-session-"
+#define SESSION_TOKEN_MAX_LEN   64
+
 #define UNDEFINED_REPLY_CODE -1
 
 #define MAX_API_LENGTH  256
@@ -89,6 +108,8 @@ typedef struct session rps_sess_t;
 #include "log.h"
 #include "array.h"
 #include "hashmap.h"
+#include "mbuf.h"
+#include "wheel.h"
 #include "server.h"
 #include "upstream.h"
 
@@ -134,6 +155,7 @@ typedef void (*rps_next_t)(struct context *);
 
 struct context {
     struct session      *sess;
+    struct context      *next; /* worker free list */
 
     union {
         uv_handle_t     handle;
@@ -145,25 +167,30 @@ struct context {
 
     uint32_t            timeout;
 
-    uv_timer_t          timer;
+    struct wheel_node   timer; /* idle timeout, hashed into the worker wheel */
     uv_write_t          write_req;
     uv_connect_t        connect_req;
     uv_shutdown_t       shutdown_req;
 
     rps_proto_t         proto;
 
-    char                rbuf[READ_BUF_SIZE];
+    /* rbuf points into rmbuf, only valid while the read callback is running */
+    char                *rbuf;
     ssize_t             nread;
-
-    char                *wbuf;
-    ssize_t             nwrite;
+    struct mbuf         *rmbuf;
+    uint32_t            rsize;  /* size of next read */
 
     /* The memory pointed to by the buffers must remain valid until the write callback gets called.
-     * So we use a buffer for write buffer ensure the wbuf is safe 
-     * and won't be overwritten before write callback called.
+     * Pending output is a chain of pool chunks, the first wflight chunks belong to
+     * the in-flight write request, new data only appends behind them.
+     * Writes only queue, the chain is flushed once per loop iteration.
      */
-    char                *wbuf2;
-    ssize_t             nwrite2;
+    struct mbuf         *whead;
+    struct mbuf         *wtail;
+    size_t              wpending; /* bytes queued, in flight included */
+    uint32_t            wnbuf;    /* chunks in chain */
+    uint32_t            wflight;  /* chunks in flight */
+    struct context      *wnext;   /* worker's flush list */
 
     rps_addr_t          peer;
     char                peername[MAX_INET_ADDRSTRLEN];
@@ -188,30 +215,40 @@ struct context {
     uint16_t            reconn;
     uint16_t            retry;
 
-    /* closing count, free context memory while counter value be 2
-     * 2 means both timer and connect have been closed.
-     * */
-    uint8_t             c_count;
-
     uint8_t             rstat;
     uint8_t             wstat;
 
     uint8_t             connecting:1;
     uint8_t             connected:1;
     uint8_t             established:1;
+    uint8_t             paused:1; /* read stopped by peer's write backpressure */
+    uint8_t             wqueued:1; /* on worker's flush list */
 };
 
 struct session {
     struct server   *server;
+    struct worker   *worker;
+    struct session  *next; /* worker free list */
 
     struct context  *request;
     struct context  *forward;
 
     struct upstream *upstream;
 
+    struct relay    *relay; /* kernel relay of established tunnel */
+    unsigned        norelay:1; /* kernel relay failed, stay on copy path */
+
     struct timeval  start;
     struct timeval  end; 
 
+    char            token[SESSION_TOKEN_MAX_LEN + 1]; /* sticky session, empty without */
+
+    uint64_t        ustart;     /* connecting the current upstream began, uv_hrtime */
+    uint64_t        uconnected; /* current upstream connected, uv_hrtime */
+
+    server_probe_cb probe;      /* health probe in progress, NULL for client sessions */
+    void            *probe_data;
+
     rps_addr_t remote;
 };
 
@@ -0,0 +1,202 @@
+#include "core.h"
+#include "health.h"
+#include "server.h"
+#include "upstream.h"
+#include "util.h"
+
+#include <uv.h>
+
+static rps_status_t
+health_parse_target(rps_addr_t *target, rps_str_t *s) {
+    char *colon;
+    int port;
+    size_t len;
+
+    if (string_empty(s)) {
+        return RPS_ERROR;
+    }
+
+    colon = strrchr((char *)s->data, ':');
+    if (colon == NULL) {
+        return RPS_ERROR;
+    }
+
+    len = colon - (char *)s->data;
+    port = atoi(colon + 1);
+
+    if (len == 0 || len >= MAX_HOSTNAME_LEN || !rps_valid_port(port)) {
+        return RPS_ERROR;
+    }
+
+    rps_addr_name(target, s->data, (uint8_t)len, (uint16_t)port);
+
+    return RPS_OK;
+}
+
+rps_status_t
+health_init(struct health *h, struct upstreams *us, struct config_upstreams *cus) {
+    h->upstreams = us;
+    h->interval = cus->health_check;
+    h->timeout = cus->health_timeout;
+    h->concurrency = MAX(cus->health_concurrency, 1);
+    h->next = 0;
+    h->inflight = 0;
+    h->nfailed = 0;
+    h->start = 0;
+
+    if (health_parse_target(&h->target, &cus->health_target) != RPS_OK) {
+        log_error("invalid health_target '%s', want host:port", cus->health_target.data);
+        return RPS_ERROR;
+    }
+
+    if (array_init(&h->ups, 64, sizeof(struct upstream *)) != RPS_OK) {
+        return RPS_ENOMEM;
+    }
+
+    if (array_init(&h->probes, 64, sizeof(struct health_probe)) != RPS_OK) {
+        array_deinit(&h->ups);
+        return RPS_ENOMEM;
+    }
+
+    if (server_probe_worker_init(&h->worker) != RPS_OK) {
+        array_deinit(&h->ups);
+        array_deinit(&h->probes);
+        return RPS_ERROR;
+    }
+
+    return RPS_OK;
+}
+
+void
+health_deinit(struct health *h) {
+    struct health_probe *p;
+
+    /* drop the holds of probes never started */
+    while (array_n(&h->probes) > h->next) {
+        p = (struct health_probe *)array_pop(&h->probes);
+        upstreams_unhold(p->u);
+    }
+
+    array_deinit(&h->ups);
+    array_deinit(&h->probes);
+    server_probe_worker_deinit(&h->worker);
+}
+
+static void health_next(struct health *h);
+
+static void
+health_on_probe(void *data, struct upstream *u, bool ok) {
+    struct health_probe *p;
+    struct health *h;
+
+    p = data;
+    h = p->health;
+
+    ASSERT(p->u == u);
+
+    if (!ok) {
+        h->nfailed++;
+    }
+
+    upstreams_probe_done(h->upstreams, p->up, u, ok);
+
+    h->inflight--;
+
+    health_next(h);
+}
+
+static void
+health_next(struct health *h) {
+    struct health_probe *p;
+    rps_status_t status;
+
+    while (h->inflight < h->concurrency && h->next < array_n(&h->probes)) {
+        p = (struct health_probe *)array_get(&h->probes, h->next++);
+
+        status = server_probe(&h->worker, p->u, &h->target, h->timeout, health_on_probe, p);
+        if (status == RPS_OK) {
+            h->inflight++;
+        } else if (status == RPS_ENOMEM) {
+            /* our fault, not the upstream's */
+            upstreams_unhold(p->u);
+        } else {
+            h->nfailed++;
+            upstreams_probe_done(h->upstreams, p->up, p->u, false);
+        }
+    }
+
+    if (h->inflight == 0 && h->next == array_n(&h->probes) && h->next > 0) {
+        log_info("health check probed %d upstreams, %d failed, used %.2f s",
+                h->next, h->nfailed, (uv_now(&h->worker.loop) - h->start) / 1000.0);
+        h->next = 0;
+        while (array_n(&h->probes)) {
+            array_pop(&h->probes);
+        }
+    }
+}
+
+static void
+health_on_timer(uv_timer_t *handle) {
+    struct health *h;
+    struct health_probe *p;
+    struct upstream_pool *up;
+    uint32_t i, j;
+
+    h = handle->data;
+
+    if (array_n(&h->probes) > 0) {
+        log_warn("health check round of %d upstreams still running, skip this one",
+                array_n(&h->probes));
+        return;
+    }
+
+    h->start = uv_now(&h->worker.loop);
+    h->nfailed = 0;
+
+    for (i = 0; i < array_n(&h->upstreams->pools); i++) {
+        up = (struct upstream_pool *)array_get(&h->upstreams->pools, i);
+
+        if (upstreams_hold(h->upstreams, up, &h->ups) != RPS_OK) {
+            log_error("hold %s upstreams for health check failed, skip the pool this round", 
+                    rps_proto_str(up->proto));
+            continue;
+        }
+
+        for (j = 0; j < array_n(&h->ups); j++) {
+            p = (struct health_probe *)array_push(&h->probes);
+            if (p == NULL) {
+                upstreams_unhold(*(struct upstream **)array_get(&h->ups, j));
+                continue;
+            }
+            p->health = h;
+            p->up = up;
+            p->u = *(struct upstream **)array_get(&h->ups, j);
+        }
+
+        while (array_n(&h->ups)) {
+            array_pop(&h->ups);
+        }
+    }
+
+    health_next(h);
+}
+
+void
+health_run(struct health *h) {
+    /* wait for upstreams load success */
+    uv_mutex_lock(&h->upstreams->mutex);
+    while (!h->upstreams->once) {
+        uv_cond_wait(&h->upstreams->ready, &h->upstreams->mutex);
+    }
+    uv_mutex_unlock(&h->upstreams->mutex);
+
+    log_notice("health check upstreams every %d s, target %s:%d, %d probes at once",
+            h->interval / 1000, h->target.addr.name.host, h->target.addr.name.port,
+            h->concurrency);
+
+    uv_timer_init(&h->worker.loop, &h->timer);
+    h->timer.data = h;
+    uv_timer_start(&h->timer, health_on_timer, 0, h->interval);
+
+    uv_run(&h->worker.loop, UV_RUN_DEFAULT);
+}
@@ -0,0 +1,47 @@
+#ifndef _RPS_HEALTH_H
+#define _RPS_HEALTH_H
+
+#include "core.h"
+#include "array.h"
+#include "config.h"
+#include "server.h"
+#include "upstream.h"
+
+#include <uv.h>
+
+/*
+ * Health checker, a thread with its own worker loop. Each round holds the enabled
+ * upstreams of every pool and probes them, at most concurrency at once, with the
+ * proxy client code of sessions: connect, handshake and CONNECT to the target.
+ * Outcomes feed the latency EWMAs and the breakers, failed upstreams are parked
+ * out of the ready set until a later round passes them.
+ */
+
+struct health_probe {
+    struct health           *health;
+    struct upstream_pool    *up;
+    struct upstream         *u;
+};
+
+struct health {
+    struct worker           worker;
+    struct upstreams        *upstreams;
+    rps_addr_t              target;
+    uint32_t                interval;    /* ms between rounds */
+    uint32_t                timeout;     /* ms, of a probe */
+    uint32_t                concurrency;
+    uv_timer_t              timer;
+    rps_array_t             ups;         /* held upstreams of a pool, reused */
+    rps_array_t             probes;      /* of the current round */
+    uint32_t                next;        /* first probe not started */
+    uint32_t                inflight;
+    uint32_t                nfailed;
+    uint64_t                start;       /* ms, round began */
+};
+
+rps_status_t health_init(struct health *h, struct upstreams *us,
+        struct config_upstreams *cus);
+void health_deinit(struct health *h);
+void health_run(struct health *h);
+
+#endif
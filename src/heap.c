@@ -0,0 +1,119 @@
+#include "core.h"
+#include "heap.h"
+
+int
+heap_init(rps_heap_t *h, uint32_t n, heap_cmp_t cmp) {
+    ASSERT(h != NULL);
+    ASSERT(n != 0);
+
+    h->n = 0;
+    h->nalloc = n;
+    h->cmp = cmp;
+
+    h->elts = rps_alloc(n * sizeof(void *));
+    if (h->elts == NULL) {
+        return RPS_ENOMEM;
+    }
+
+    return RPS_OK;
+}
+
+void
+heap_deinit(rps_heap_t *h) {
+    if (h->elts != NULL) {
+        rps_free(h->elts);
+    }
+    h->elts = NULL;
+    h->n = 0;
+}
+
+static void
+heap_sift_up(rps_heap_t *h, uint32_t i) {
+    uint32_t parent;
+    void *e;
+
+    e = h->elts[i];
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (h->cmp(e, h->elts[parent]) >= 0) {
+            break;
+        }
+        h->elts[i] = h->elts[parent];
+        i = parent;
+    }
+
+    h->elts[i] = e;
+}
+
+static void
+heap_sift_down(rps_heap_t *h, uint32_t i) {
+    uint32_t child;
+    void *e;
+
+    e = h->elts[i];
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= h->n) {
+            break;
+        }
+        if (child + 1 < h->n && h->cmp(h->elts[child + 1], h->elts[child]) < 0) {
+            child++;
+        }
+        if (h->cmp(h->elts[child], e) >= 0) {
+            break;
+        }
+        h->elts[i] = h->elts[child];
+        i = child;
+    }
+
+    h->elts[i] = e;
+}
+
+int
+heap_push(rps_heap_t *h, void *e) {
+    void **elts;
+
+    if (h->n >= h->nalloc) {
+        elts = rps_realloc(h->elts, 2 * h->nalloc * sizeof(void *));
+        if (elts == NULL) {
+            return RPS_ENOMEM;
+        }
+        h->elts = elts;
+        h->nalloc *= 2;
+    }
+
+    h->elts[h->n] = e;
+    heap_sift_up(h, h->n);
+    h->n++;
+
+    return RPS_OK;
+}
+
+void *
+heap_pop(rps_heap_t *h) {
+    void *e;
+
+    if (heap_is_empty(h)) {
+        return NULL;
+    }
+
+    e = h->elts[0];
+    h->n--;
+
+    if (h->n > 0) {
+        h->elts[0] = h->elts[h->n];
+        heap_sift_down(h, 0);
+    }
+
+    return e;
+}
+
+/* Restore order after the key of the top element grew */
+void
+heap_fix_top(rps_heap_t *h) {
+    if (h->n > 1) {
+        heap_sift_down(h, 0);
+    }
+}
@@ -0,0 +1,36 @@
+/*
+ * Binary min heap of pointers, ordered by a compare function
+ */
+
+#ifndef _RPS_HEAP_H
+#define _RPS_HEAP_H
+
+#include <stdint.h>
+
+typedef int (*heap_cmp_t)(const void *, const void *);
+
+struct rps_heap_s {
+    void        **elts;
+    uint32_t    n;
+    uint32_t    nalloc;
+    heap_cmp_t  cmp;
+};
+
+typedef struct rps_heap_s rps_heap_t;
+
+#define heap_n(_h)                                      \
+    ((_h)->n)
+
+#define heap_is_empty(_h)                               \
+    ((_h)->n == 0)
+
+#define heap_top(_h)                                    \
+    ((_h)->n > 0 ? (_h)->elts[0] : NULL)
+
+int heap_init(rps_heap_t *h, uint32_t n, heap_cmp_t cmp);
+void heap_deinit(rps_heap_t *h);
+int heap_push(rps_heap_t *h, void *e);
+void *heap_pop(rps_heap_t *h);
+void heap_fix_top(rps_heap_t *h);
+
+#endif
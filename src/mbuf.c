@@ -0,0 +1,114 @@
+#include "core.h"
+#include "mbuf.h"
+#include "util.h"
+
+static uint32_t
+mbuf_class(size_t size) {
+    uint32_t cls;
+
+    ASSERT(size <= MBUF_MAX_SIZE);
+
+    for (cls = 0; cls < MBUF_NCLASS - 1; cls++) {
+        if (size <= ((size_t)MBUF_MIN_SIZE << cls)) {
+            break;
+        }
+    }
+
+    return cls;
+}
+
+void
+mbuf_pool_init(struct mbuf_pool *pool) {
+    uint32_t i;
+
+    for (i = 0; i < MBUF_NCLASS; i++) {
+        pool->free[i] = NULL;
+        pool->nfree[i] = 0;
+    }
+
+    pool->nused = 0;
+    pool->bused = 0;
+}
+
+void
+mbuf_pool_deinit(struct mbuf_pool *pool) {
+    uint32_t i;
+    struct mbuf *mb;
+
+    if (pool->nused > 0) {
+        log_warn("mbuf pool deinit with %d chunks in use", pool->nused);
+    }
+
+    for (i = 0; i < MBUF_NCLASS; i++) {
+        while (pool->free[i] != NULL) {
+            mb = pool->free[i];
+            pool->free[i] = mb->next;
+            rps_free(mb);
+        }
+        pool->nfree[i] = 0;
+    }
+}
+
+/* Get a chunk with at least size bytes room, size must not exceed MBUF_MAX_SIZE */
+struct mbuf *
+mbuf_get(struct mbuf_pool *pool, size_t size) {
+    struct mbuf *mb;
+    uint32_t cls;
+    size_t capacity;
+
+    cls = mbuf_class(size);
+    capacity = (size_t)MBUF_MIN_SIZE << cls;
+
+    if (pool->free[cls] != NULL) {
+        mb = pool->free[cls];
+        pool->free[cls] = mb->next;
+        pool->nfree[cls]--;
+    } else {
+        /* chunk header and data live in one allocation */
+        mb = rps_alloc(sizeof(struct mbuf) + capacity);
+        if (mb == NULL) {
+            return NULL;
+        }
+        mb->pool = pool;
+        mb->cls = cls;
+        mb->start = (uint8_t *)mb + sizeof(struct mbuf);
+        mb->end = mb->start + capacity;
+    }
+
+    mb->next = NULL;
+    mb->refcount = 1;
+    mb->pos = mb->start;
+    mb->last = mb->start;
+
+    pool->nused++;
+    pool->bused += capacity;
+
+    return mb;
+}
+
+void
+mbuf_put(struct mbuf *mb) {
+    struct mbuf_pool *pool;
+    uint32_t cls;
+
+    ASSERT(mb->refcount > 0);
+
+    if (--mb->refcount > 0) {
+        return;
+    }
+
+    pool = mb->pool;
+    cls = mb->cls;
+
+    pool->nused--;
+    pool->bused -= mbuf_capacity(mb);
+
+    if (((size_t)pool->nfree[cls] + 1) * mbuf_capacity(mb) > MBUF_POOL_FREE_BYTES) {
+        rps_free(mb);
+        return;
+    }
+
+    mb->next = pool->free[cls];
+    pool->free[cls] = mb;
+    pool->nfree[cls]++;
+}
@@ -0,0 +1,70 @@
+/*
+ * Reference counted buffer chunks carved from a per event loop pool.
+ *
+ * Chunks come in power of two size classes from MBUF_MIN_SIZE to MBUF_MAX_SIZE,
+ * released chunks are cached on per class free lists for reuse.
+ * A pool is owned by exactly one loop, so no locking here.
+ */
+
+#ifndef _RPS_MBUF_H
+#define _RPS_MBUF_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define MBUF_MIN_SHIFT      11
+#define MBUF_MAX_SHIFT      16
+#define MBUF_NCLASS         (MBUF_MAX_SHIFT - MBUF_MIN_SHIFT + 1)
+#define MBUF_MIN_SIZE       (1 << MBUF_MIN_SHIFT) //2k
+#define MBUF_MAX_SIZE       (1 << MBUF_MAX_SHIFT) //64k
+
+/* Max bytes cached by each size class free list, the rest go back to malloc */
+#define MBUF_POOL_FREE_BYTES    (4 * 1024 * 1024) //4M
+
+struct mbuf_pool;
+
+struct mbuf {
+    struct mbuf         *next;  /* next chunk in free list or write chain */
+    struct mbuf_pool    *pool;
+    uint32_t            refcount;
+    uint32_t            cls;    /* size class index */
+    uint8_t             *pos;   /* unconsumed data start */
+    uint8_t             *last;  /* data end */
+    uint8_t             *start;
+    uint8_t             *end;
+};
+
+struct mbuf_pool {
+    struct mbuf         *free[MBUF_NCLASS];
+    uint32_t            nfree[MBUF_NCLASS];
+    uint32_t            nused;  /* chunks held by users */
+    size_t              bused;  /* bytes held by users */
+};
+
+static inline size_t
+mbuf_length(struct mbuf *mb) {
+    return (size_t)(mb->last - mb->pos);
+}
+
+static inline size_t
+mbuf_room(struct mbuf *mb) {
+    return (size_t)(mb->end - mb->last);
+}
+
+static inline size_t
+mbuf_capacity(struct mbuf *mb) {
+    return (size_t)(mb->end - mb->start);
+}
+
+static inline struct mbuf *
+mbuf_ref(struct mbuf *mb) {
+    mb->refcount++;
+    return mb;
+}
+
+void mbuf_pool_init(struct mbuf_pool *pool);
+void mbuf_pool_deinit(struct mbuf_pool *pool);
+struct mbuf *mbuf_get(struct mbuf_pool *pool, size_t size);
+void mbuf_put(struct mbuf *mb);
+
+#endif
@@ -1062,7 +1062,6 @@ http_basic_auth(struct context *ctx, rps_str_t *param) {
     char *uname, *passwd;
     char plain[256];
     int length;
-    struct server *s;
     base64_decodestate bstate;
 
     length = 0;
@@ -1086,13 +1085,9 @@ http_basic_auth(struct context *ctx, rps_str_t *param) {
         return false;
     }
 
-    s = ctx->sess->server;
-    
-    if (rps_strcmp(&s->cfg->username, uname) == 0 && 
-        rps_strcmp(&s->cfg->password, passwd) == 0) {
+    if (server_sess_auth(ctx->sess, uname, passwd)) {
         return true;
     }
-    
 
     return false;
 }
@@ -1439,6 +1434,70 @@ http_send_request(struct context *ctx) {
 
 }
 
+/* Health probe of a plain http proxy, a request for the target's root without body */
+rps_status_t
+http_send_probe(struct context *ctx) {
+    struct upstream *u;
+    char host[MAX_HOSTNAME_LEN];
+    char auth[HTTP_HEADER_MAX_VALUE_LENGTH];
+    char message[HTTP_PROBE_MAX_LENGTH];
+    uint16_t port;
+    int len;
+
+    u = ctx->sess->upstream;
+
+    if (rps_unresolve_addr(&ctx->sess->remote, host) != 0) {
+        return RPS_ERROR;
+    }
+    port = rps_unresolve_port(&ctx->sess->remote);
+
+    auth[0] = '\0';
+    if (!string_empty(&u->uname)) {
+        http_basic_auth_gen((const char *)u->uname.data, (const char *)u->passwd.data, auth);
+    }
+
+    len = snprintf(message, sizeof(message), 
+            "HEAD http://%s:%d/ HTTP/1.1\r\n"
+            "Host: %s:%d\r\n"
+            "%s%s%s"
+            "Connection: close\r\n\r\n",
+            host, port, host, port,
+            auth[0] ? "Proxy-Authorization: " : "", auth, auth[0] ? "\r\n" : "");
+    if (len < 0 || (size_t)len >= sizeof(message)) {
+        return RPS_ERROR;
+    }
+
+    return server_write(ctx, message, len);
+}
+
+/* 
+ * Any reply of the target proves the proxy works, a 5xx may be the proxy's own
+ * and 407 means it refused our credentials.
+ */
+bool
+http_probe_verify(struct context *ctx) {
+    struct http_response resp;
+    bool ok;
+
+    http_response_init(&resp);
+
+    if (http_response_parse(&resp, (uint8_t *)ctx->rbuf, (size_t)ctx->nread) != RPS_OK) {
+        http_response_deinit(&resp);
+        log_debug("http upstream %s return invalid probe response", ctx->peername);
+        return false;
+    }
+
+    ok = resp.code >= 200 && resp.code < 500 && resp.code != http_proxy_auth_required;
+    if (!ok) {
+        log_debug("http upstream %s probe failed, %d %s", ctx->peername, 
+                resp.code, resp.status.data);
+    }
+
+    http_response_deinit(&resp);
+
+    return ok;
+}
+
 rps_status_t
 http_send_response(struct context *ctx, uint16_t code) {
     struct http_response resp;
@@ -14,6 +14,7 @@
 #define HTTP_BODY_MAX_LENGTH    2048
 // 1M is big enough in our approach
 #define HTTP_MESSAGE_MAX_LENGTH    1024 * 1024
+#define HTTP_PROBE_MAX_LENGTH      4096
 
 #define HTTP_MIN_STATUS_CODE    100
 #define HTTP_MAX_STATUS_CODE    599
@@ -206,5 +207,7 @@ int http_request_verify(struct context *ctx);
 int http_response_verify(struct context *ctx);
 rps_status_t http_send_response(struct context *ctx, uint16_t code);
 rps_status_t http_send_request(struct context *ctx);
+rps_status_t http_send_probe(struct context *ctx);
+bool http_probe_verify(struct context *ctx);
 
 #endif
@@ -8,19 +8,32 @@ http_tunnel_send_request(struct context *ctx) {
     struct upstream *u;
     size_t i;
     char message[HTTP_MESSAGE_MAX_LENGTH];
+    char host[MAX_HOSTNAME_LEN];
     int len;
 
-    req = ctx->sess->request->req;
-
-    ASSERT(req != NULL);
-
     http_request_init(&nreq);
     nreq.method = http_connect;
-    nreq.port = req->port;
-    string_copy(&nreq.host, &req->host);
-    string_copy(&nreq.version, &req->version);
-    string_copy(&nreq.full_uri, &req->full_uri);
-    hashmap_deepcopy(&nreq.headers, &req->headers);
+
+    if (ctx->sess->request == NULL) {
+        /* health probe, CONNECT the canary target */
+        if (rps_unresolve_addr(&ctx->sess->remote, host) != 0) {
+            http_request_deinit(&nreq);
+            return RPS_ERROR;
+        }
+        nreq.port = rps_unresolve_port(&ctx->sess->remote);
+        string_duplicate(&nreq.host, host, strlen(host));
+        string_duplicate(&nreq.version, HTTP_DEFAULT_VERSION, strlen(HTTP_DEFAULT_VERSION));
+    } else {
+        req = ctx->sess->request->req;
+
+        ASSERT(req != NULL);
+
+        nreq.port = req->port;
+        string_copy(&nreq.host, &req->host);
+        string_copy(&nreq.version, &req->version);
+        string_copy(&nreq.full_uri, &req->full_uri);
+        hashmap_deepcopy(&nreq.headers, &req->headers);
+    }
     
 
     for (i = 0; i < BYPASS_PROXY_HEADER_LEN; i++) {
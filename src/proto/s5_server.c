@@ -97,7 +97,6 @@ kill:
 static void
 s5_do_auth(struct context *ctx, uint8_t *data, size_t size) {
     ctx_state_t new_state;
-    struct server *s;
     struct s5_auth_request *req;
     struct s5_auth_response resp;
     rps_status_t status;
@@ -127,13 +126,10 @@ s5_do_auth(struct context *ctx, uint8_t *data, size_t size) {
         
     }
 
-    s = ctx->sess->server;
-
     memset(&resp, 0, sizeof(struct s5_auth_response));
 
     resp.ver = SOCKS5_AUTH_PASSWD_VERSION;
-    if (rps_strcmp(&s->cfg->username, req->uname) == 0 && 
-        rps_strcmp(&s->cfg->password, req->passwd) == 0) {
+    if (server_sess_auth(ctx->sess, (const char *)req->uname, (const char *)req->passwd)) {
         resp.status = s5_auth_allow;
         new_state = c_requests;
     } else {
@@ -0,0 +1,149 @@
+#include "core.h"
+#include "rate.h"
+
+void
+rate_init(struct rate *r) {
+    memset(r, 0, sizeof(*r));
+}
+
+/* Drop buckets left behind since the last touch, at most one round of them */
+static void
+rate_ring_advance(struct rate_ring *ring, uint32_t *slots, uint32_t n, int64_t unit) {
+    int64_t i;
+
+    if (unit <= ring->last) {
+        return;
+    }
+
+    if (unit - ring->last >= n) {
+        memset(slots, 0, n * sizeof(uint32_t));
+        ring->sum = 0;
+    } else {
+        for (i = ring->last + 1; i <= unit; i++) {
+            ring->sum -= slots[i % n];
+            slots[i % n] = 0;
+        }
+    }
+
+    ring->last = unit;
+}
+
+static void
+rate_advance(struct rate *r, struct rate_limit *limit, uint64_t now_ms) {
+    uint64_t now, burst;
+
+    now = now_ms / 1000;
+
+    rate_ring_advance(&r->minute, r->seconds, RATE_MINUTE_SLOTS, now);
+    rate_ring_advance(&r->hour, r->minutes, RATE_HOUR_SLOTS, now / 60);
+    rate_ring_advance(&r->day, r->hours, RATE_DAY_SLOTS, now / 3600);
+
+    if (limit->rate == 0) {
+        return;
+    }
+
+    burst = (uint64_t)(limit->burst > 0 ? limit->burst : limit->rate) * 1000;
+
+    if (r->refill == 0) {
+        /* starts full */
+        r->tokens = burst;
+    } else if (now_ms > r->refill) {
+        r->tokens = MIN(burst, r->tokens + (now_ms - r->refill) * limit->rate);
+    }
+
+    r->refill = now_ms;
+}
+
+bool
+rate_allow(struct rate *r, struct rate_limit *limit, uint64_t now_ms) {
+    rate_advance(r, limit, now_ms);
+
+    if (limit->mr1m > 0 && r->minute.sum >= limit->mr1m) {
+        return false;
+    }
+
+    if (limit->mr1h > 0 && r->hour.sum >= limit->mr1h) {
+        return false;
+    }
+
+    if (limit->mr1d > 0 && r->day.sum >= limit->mr1d) {
+        return false;
+    }
+
+    if (limit->rate > 0 && r->tokens < 1000) {
+        return false;
+    }
+
+    return true;
+}
+
+/* Count a request, call after rate_allow with the same time */
+void
+rate_add(struct rate *r, struct rate_limit *limit, uint64_t now_ms) {
+    uint64_t now;
+
+    now = now_ms / 1000;
+
+    r->seconds[now % RATE_MINUTE_SLOTS]++;
+    r->minutes[(now / 60) % RATE_HOUR_SLOTS]++;
+    r->hours[(now / 3600) % RATE_DAY_SLOTS]++;
+    r->minute.sum++;
+    r->hour.sum++;
+    r->day.sum++;
+
+    if (limit->rate > 0) {
+        r->tokens -= MIN(r->tokens, 1000);
+    }
+}
+
+/* First unit the ring holds less than max in, as its oldest buckets drop out */
+static int64_t
+rate_ring_next(struct rate_ring *ring, uint32_t *slots, uint32_t n, uint32_t max) {
+    int64_t i;
+    uint32_t sum;
+
+    sum = ring->sum;
+
+    for (i = MAX(ring->last - n + 1, 0); i <= ring->last; i++) {
+        sum -= slots[i % n];
+        if (sum < max) {
+            /* bucket of unit i is dropped at unit i + n */
+            return i + n;
+        }
+    }
+
+    return ring->last + 1;
+}
+
+/* 
+ * Earliest time rate_allow may pass again after it refused, ms. Call with the 
+ * state rate_allow left, nothing is counted in between.
+ */
+uint64_t
+rate_next(struct rate *r, struct rate_limit *limit, uint64_t now_ms) {
+    uint64_t next;
+
+    next = now_ms;
+
+    if (limit->mr1m > 0 && r->minute.sum >= limit->mr1m) {
+        next = MAX(next, (uint64_t)rate_ring_next(&r->minute, r->seconds, 
+                    RATE_MINUTE_SLOTS, limit->mr1m) * 1000);
+    }
+
+    if (limit->mr1h > 0 && r->hour.sum >= limit->mr1h) {
+        next = MAX(next, (uint64_t)rate_ring_next(&r->hour, r->minutes, 
+                    RATE_HOUR_SLOTS, limit->mr1h) * 60000);
+    }
+
+    if (limit->mr1d > 0 && r->day.sum >= limit->mr1d) {
+        next = MAX(next, (uint64_t)rate_ring_next(&r->day, r->hours, 
+                    RATE_DAY_SLOTS, limit->mr1d) * 3600000);
+    }
+
+    /* tokens refill rate per ms */
+    if (limit->rate > 0 && r->tokens < 1000) {
+        next = MAX(next, now_ms + (1000 - r->tokens + limit->rate - 1) / limit->rate);
+    }
+
+    return next;
+}
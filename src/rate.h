@@ -0,0 +1,57 @@
+/*
+ * Sliding window request counters with an optional token bucket.
+ *
+ * The last minute, hour and day are rings of per second, per minute and per hour
+ * buckets with running sums. Buckets rotate lazily when touched, so a check or an
+ * add is constant time whatever the limits are.
+ */
+
+#ifndef _RPS_RATE_H
+#define _RPS_RATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define RATE_MINUTE_SLOTS   60  /* per second */
+#define RATE_HOUR_SLOTS     60  /* per minute */
+#define RATE_DAY_SLOTS      24  /* per hour */
+
+/* 0 means no limits */
+struct rate_limit {
+    uint32_t    mr1m;
+    uint32_t    mr1h;
+    uint32_t    mr1d;
+    uint32_t    rate;   /* token bucket refill, requests per second */
+    uint32_t    burst;  /* token bucket size, rate if 0 */
+};
+
+struct rate_ring {
+    int64_t     last;   /* unit of the newest bucket */
+    uint32_t    sum;
+};
+
+struct rate {
+    struct rate_ring    minute;
+    struct rate_ring    hour;
+    struct rate_ring    day;
+    uint32_t            seconds[RATE_MINUTE_SLOTS];
+    uint32_t            minutes[RATE_HOUR_SLOTS];
+    uint32_t            hours[RATE_DAY_SLOTS];
+    uint64_t            tokens;     /* in 1/1000 request */
+    uint64_t            refill;     /* ms */
+};
+
+static inline bool
+rate_limited(struct rate_limit *limit) {
+    return limit->mr1m > 0 || limit->mr1h > 0 || limit->mr1d > 0 || limit->rate > 0;
+}
+
+/* requests of the last day, as of the last touch */
+#define rate_day_n(_r)      ((_r)->day.sum)
+
+void rate_init(struct rate *r);
+bool rate_allow(struct rate *r, struct rate_limit *limit, uint64_t now_ms);
+void rate_add(struct rate *r, struct rate_limit *limit, uint64_t now_ms);
+uint64_t rate_next(struct rate *r, struct rate_limit *limit, uint64_t now_ms);
+
+#endif
@@ -5,6 +5,7 @@
 #include "util.h"
 #include "server.h"
 #include "upstream.h"
+#include "health.h"
 #include "_signal.h"
 
 #include <uv.h>
@@ -229,13 +230,32 @@ rps_server_load(struct application *app) {
     rps_status_t status;
     struct config_server *cfg;
     struct server *s;
+    struct worker_pool *pool;
 
 	array_null(&app->servers);
+    array_null(&app->pool.workers);
+
+    pool = NULL;
+
+    if (string_empty(&app->cfg.servers.accept) || 
+            rps_strcmp(&app->cfg.servers.accept, "reuseport") == 0) {
+        app->accept_mode = accept_mode_reuseport;
+    } else if (rps_strcmp(&app->cfg.servers.accept, "handoff") == 0) {
+        app->accept_mode = accept_mode_handoff;
+        if (server_pool_init(&app->pool, &app->cfg.servers) != RPS_OK) {
+            return RPS_ERROR;
+        }
+        pool = &app->pool;
+    } else {
+        log_error("unsupport accept mode: %s", app->cfg.servers.accept.data);
+        return RPS_ERROR;
+    }
 
     n = array_n(app->cfg.servers.ss);
 
     status = array_init(&app->servers, n , sizeof(struct server));   
     if (status != RPS_OK) {
+        server_pool_deinit(&app->pool);
         return status;
     }
     
@@ -246,7 +266,7 @@ rps_server_load(struct application *app) {
             goto error;
         }
         
-        status = server_init(s, cfg, &app->upstreams, 
+        status = server_init(s, cfg, &app->upstreams, pool, 
                 app->cfg.servers.rtimeout, app->cfg.servers.ftimeout);
         if (status != RPS_OK) {
             goto error;
@@ -261,48 +281,14 @@ error:
         server_deinit((struct server *)array_pop(&app->servers));
     }
     array_deinit(&app->servers);
+    server_pool_deinit(&app->pool);
 
     return RPS_ERROR;
 }
 
 static void
-rps_add_crontab(struct application *app, uv_timer_cb callback, uint64_t repeat) {
-    uv_loop_t *loop;
-    uv_timer_t *timer;
-
-    loop = rps_alloc(sizeof(uv_loop_t));
-
-    ASSERT(loop != NULL);
-    
-    uv_loop_init(loop);
-
-    timer = (uv_timer_t *)rps_alloc(sizeof(*timer));
-    
-    timer->data = &app->upstreams;
-
-    uv_timer_init(loop, timer);
-    uv_timer_start(timer, callback, 0, repeat);
-
-    uv_run(loop, UV_RUN_DEFAULT);
-
-    uv_loop_close(loop);
-    uv_loop_delete(loop);
-    rps_free(loop);
-    rps_free(timer);
-}
-
-static void
-rps_upstreams_refresh(struct application *app) {
-    rps_add_crontab(app, 
-            (uv_timer_cb)upstreams_refresh, 
-            app->cfg.upstreams.refresh);
-}
-
-static void
-rps_upstreams_stats(struct application *app) {
-    rps_add_crontab(app, 
-            (uv_timer_cb)upstreams_stats, 
-            app->cfg.upstreams.stats);
+rps_upstreams_run(struct application *app) {
+    upstreams_run(&app->upstreams, app->cfg.upstreams.refresh, app->cfg.upstreams.stats);
 }
 
 static void
@@ -311,6 +297,7 @@ rps_teardown(struct application *app) {
         server_deinit((struct server *)array_pop(&app->servers));
     }
     array_deinit(&app->servers);
+    server_pool_deinit(&app->pool);
 
 	upstreams_deinit(&app->upstreams);
     config_deinit(&app->cfg);
@@ -384,7 +371,15 @@ rps_run(struct application *app) {
         return;
     }
 
-    n = array_n(&app->servers) + 1; // Add 1 upstream auto-refresh thread
+    if (app->cfg.upstreams.health_check > 0) {
+        status = health_init(&app->health, &app->upstreams, &app->cfg.upstreams);
+        if (status != RPS_OK) {
+            log_error("health checker init failed");
+            return;
+        }
+    }
+
+    n = array_n(&app->servers) + 1; // Add 1 upstreams control plane thread
     
     status = array_init(&threads, n , sizeof(uv_thread_t));   
     if (status != RPS_OK) {
@@ -392,10 +387,16 @@ rps_run(struct application *app) {
     }
 
     tid = (uv_thread_t *)array_push(&threads);
-    uv_thread_create(tid, (uv_thread_cb)rps_upstreams_refresh, app);
-    
-    tid = (uv_thread_t *)array_push(&threads);
-    uv_thread_create(tid, (uv_thread_cb)rps_upstreams_stats, app);
+    uv_thread_create(tid, (uv_thread_cb)rps_upstreams_run, app);
+
+    if (app->cfg.upstreams.health_check > 0) {
+        tid = (uv_thread_t *)array_push(&threads);
+        uv_thread_create(tid, (uv_thread_cb)health_run, &app->health);
+    }
+
+    if (app->accept_mode == accept_mode_handoff) {
+        server_pool_run(&app->pool);
+    }
     
     for (i = 0; i < array_n(&app->servers); i++) {
         tid = (uv_thread_t *)array_push(&threads);
@@ -409,6 +410,10 @@ rps_run(struct application *app) {
 
     array_deinit(&threads);
 
+    if (app->accept_mode == accept_mode_handoff) {
+        server_pool_wait(&app->pool);
+    }
+
     rps_teardown(app);
 }
 
@@ -4,6 +4,7 @@
 #include "core.h"
 #include "array.h"
 #include "config.h"
+#include "health.h"
 
 #include <sys/types.h>
 
@@ -23,7 +24,11 @@
 struct application {
     rps_array_t             servers;
 
+    accept_mode_t           accept_mode;
+    struct worker_pool      pool; /* handoff mode, workers shared by all servers */
+
     struct upstreams        upstreams;
+    struct health           health;
 
     int                     log_level;
     char                    *log_filename;
@@ -7,26 +7,151 @@
 #include "proto/http_proxy.h"
 #include "proto/http_tunnel.h"
 
+#include <errno.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <linux/filter.h>
+#endif
 
-rps_status_t
-server_init(struct server *s, struct config_server *cfg, 
-        struct upstreams *us, uint32_t rtimeout, uint32_t ftimeout) {
+static rps_status_t
+server_worker_init(struct worker *w, struct server *s, uint32_t id, int cpu) {
     int err;
-    int status;
 
-    err = uv_loop_init(&s->loop);
+    err = uv_loop_init(&w->loop);
     if (err != 0) {
         UV_SHOW_ERROR(err, "loop init");
         return RPS_ERROR;
     }
 
-    err = uv_tcp_init(&s->loop, &s->us);
-    if (err !=0 ) {
-        UV_SHOW_ERROR(err, "tcp init");
-        return RPS_ERROR;
+    mbuf_pool_init(&w->mbufs);
+    w->free_sess = NULL;
+    w->free_ctx = NULL;
+    w->nfree_sess = 0;
+    w->nfree_ctx = 0;
+    w->sess_hits = 0;
+    w->sess_misses = 0;
+    w->ctx_hits = 0;
+    w->ctx_misses = 0;
+    w->pipes = NULL;
+    w->npipes = 0;
+    sockmap_null(&w->sockmap);
+    w->sockmap_ready = 0;
+    w->sockmap_failed = 0;
+    w->inbox = NULL;
+    w->wready = NULL;
+    w->nhandoff = 0;
+    w->nsess = 0;
+
+    w->server = s;
+    w->name = s != NULL ? (const char *)s->cfg->proto.data : "pool";
+    w->id = id;
+    w->cpu = cpu;
+
+    return RPS_OK;
+}
+
+static void
+server_worker_deinit(struct worker *w) {
+    struct splice_pipe *p;
+    struct handoff *h;
+    rps_sess_t *sess;
+    rps_ctx_t *ctx;
+
+    uv_loop_close(&w->loop);
+    mbuf_pool_deinit(&w->mbufs);
+
+    while (w->inbox != NULL) {
+        h = w->inbox;
+        w->inbox = h->next;
+        close(h->fd);
+        rps_free(h);
+    }
+
+    while (w->free_sess != NULL) {
+        sess = w->free_sess;
+        w->free_sess = sess->next;
+        rps_free(sess);
+    }
+    w->nfree_sess = 0;
+
+    while (w->free_ctx != NULL) {
+        ctx = w->free_ctx;
+        w->free_ctx = ctx->next;
+        rps_free(ctx);
+    }
+    w->nfree_ctx = 0;
+
+    while (w->pipes != NULL) {
+        p = w->pipes;
+        w->pipes = p->next;
+        close(p->fds[0]);
+        close(p->fds[1]);
+        rps_free(p);
+    }
+    w->npipes = 0;
+
+    if (w->sockmap_ready) {
+        sockmap_deinit(&w->sockmap);
+        w->sockmap_ready = 0;
+    }
+    w->server = NULL;
+}
+
+/* 
+ * Parse cpu list like "0,2,4,6" or "0 1 2 3" into cpus, 
+ * return the number of cpus parsed or -1 on invalid list.
+ */
+static int
+server_parse_affinity(rps_str_t *affinity, int *cpus, int max) {
+    char *p, *end;
+    long cpu;
+    int n;
+
+    n = 0;
+
+    if (string_empty(affinity)) {
+        return 0;
     }
 
-    s->us.data = s;
+    p = (char *)affinity->data;
+
+    while (*p != '\0') {
+        if (*p == ',' || *p == ' ') {
+            p++;
+            continue;
+        }
+
+        cpu = strtol(p, &end, 10);
+        if (end == p || cpu < 0 || n >= max) {
+            return -1;
+        }
+        
+        cpus[n++] = (int)cpu;
+        p = end;
+    }
+
+    return n;
+}
+
+rps_status_t
+server_init(struct server *s, struct config_server *cfg, 
+        struct upstreams *us, struct worker_pool *pool, uint32_t rtimeout, uint32_t ftimeout) {
+    int status;
+    int cpus[SERVER_MAX_WORKERS];
+    int ncpu;
+    uint32_t i, n;
+    struct worker *w;
+
+    array_null(&s->workers);
+    s->pool = NULL;
+    s->fd = -1;
+    s->cursor = 0;
 
     s->proto = rps_proto_int((const char *)cfg->proto.data);
 
@@ -41,33 +166,245 @@ server_init(struct server *s, struct config_server *cfg,
         return RPS_ERROR;
     }
 
+    ncpu = server_parse_affinity(&cfg->cpu_affinity, cpus, SERVER_MAX_WORKERS);
+    if (ncpu < 0) {
+        log_error("invalid cpu affinity: %s", cfg->cpu_affinity.data);
+        return RPS_ERROR;
+    }
+
+    if (string_empty(&cfg->tunnel_engine) || rps_strcmp(&cfg->tunnel_engine, "copy") == 0) {
+        s->engine = tunnel_engine_copy;
+    } else if (rps_strcmp(&cfg->tunnel_engine, "splice") == 0) {
+#ifdef __linux__
+        s->engine = tunnel_engine_splice;
+#else
+        log_warn("splice tunnel engine is linux only, fallback to copy");
+        s->engine = tunnel_engine_copy;
+#endif
+    } else if (rps_strcmp(&cfg->tunnel_engine, "sockmap") == 0) {
+#ifdef __linux__
+        s->engine = tunnel_engine_sockmap;
+#else
+        log_warn("sockmap tunnel engine is linux only, fallback to copy");
+        s->engine = tunnel_engine_copy;
+#endif
+    } else {
+        log_error("unsupport tunnel engine: %s", cfg->tunnel_engine.data);
+        return RPS_ERROR;
+    }
+
     s->cfg = cfg;
     s->upstreams = us;
     s->rtimeout = rtimeout;
     s->ftimeout = ftimeout;
 
+    if (pool != NULL) {
+        if (cfg->workers > 1 || ncpu > 0 || cfg->reuseport_cbpf) {
+            log_warn("%s proxy on %s:%d: listener workers settings are ignored in handoff mode", 
+                    cfg->proto.data, cfg->listen.data, cfg->port);
+        }
+
+        /* acceptor loop, sessions run on the pool workers */
+        status = uv_loop_init(&s->loop);
+        if (status != 0) {
+            UV_SHOW_ERROR(status, "loop init");
+            return RPS_ERROR;
+        }
+
+        s->pool = pool;
+        return RPS_OK;
+    }
+
+    n = MAX(cfg->workers, 1);
+
+    if (array_init(&s->workers, n, sizeof(struct worker)) != RPS_OK) {
+        return RPS_ENOMEM;
+    }
+
+    for (i = 0; i < n; i++) {
+        w = (struct worker *)array_push(&s->workers);
+        status = server_worker_init(w, s, i, 
+                ncpu > 0 ? cpus[i % ncpu] : WORKER_CPU_UNSET);
+        if (status != RPS_OK) {
+            array_pop(&s->workers);
+            server_deinit(s);
+            return RPS_ERROR;
+        }
+    }
+
     return RPS_OK;
 }
 
 
 void
 server_deinit(struct server *s) {
-    uv_loop_close(&s->loop);
+    while (array_n(&s->workers)) {
+        server_worker_deinit((struct worker *)array_pop(&s->workers));
+    }
+    array_deinit(&s->workers);
+
+    if (s->pool != NULL) {
+        if (s->fd >= 0) {
+            close(s->fd);
+            s->fd = -1;
+        }
+        uv_loop_close(&s->loop);
+        s->pool = NULL;
+    }
+}
+
+/*
+ * Sessions and contexts are recycled by the worker which owns them, 
+ * uv handles embedded are closed before put and initialized again after get.
+ * Active sessions are counted here, handoff acceptors read the counter to balance.
+ */
+static rps_sess_t *
+server_sess_get(struct worker *w) {
+    rps_sess_t *sess;
+
+    if (w->free_sess != NULL) {
+        sess = w->free_sess;
+        w->free_sess = sess->next;
+        w->nfree_sess--;
+        w->sess_hits++;
+    } else {
+        w->sess_misses++;
+        sess = (rps_sess_t *)rps_alloc(sizeof(struct session));
+        if (sess == NULL) {
+            return NULL;
+        }
+    }
+
+    __atomic_store_n(&w->nsess, w->nsess + 1, __ATOMIC_RELAXED);
+
+    return sess;
+}
+
+static void
+server_sess_put(struct worker *w, rps_sess_t *sess) {
+    __atomic_store_n(&w->nsess, w->nsess - 1, __ATOMIC_RELAXED);
+
+    if (w->nfree_sess >= WORKER_FREE_SESS_MAX) {
+        rps_free(sess);
+        return;
+    }
+
+    sess->next = w->free_sess;
+    w->free_sess = sess;
+    w->nfree_sess++;
+}
+
+static rps_ctx_t *
+server_ctx_get(struct worker *w) {
+    rps_ctx_t *ctx;
+
+    if (w->free_ctx != NULL) {
+        ctx = w->free_ctx;
+        w->free_ctx = ctx->next;
+        w->nfree_ctx--;
+        w->ctx_hits++;
+        return ctx;
+    }
 
-    /* Make valgrind happy */
-    uv_loop_delete(&s->loop);
+    w->ctx_misses++;
+
+    return (rps_ctx_t *)rps_alloc(sizeof(struct context));
+}
+
+static void
+server_ctx_put(struct worker *w, rps_ctx_t *ctx) {
+    if (w->nfree_ctx >= WORKER_FREE_CTX_MAX) {
+        rps_free(ctx);
+        return;
+    }
+
+    ctx->next = w->free_ctx;
+    w->free_ctx = ctx;
+    w->nfree_ctx++;
 }
 
 static void
-server_sess_init(rps_sess_t *sess, struct server *s) {
+server_sess_init(rps_sess_t *sess, struct worker *w, struct server *s) {
     sess->server = s;
+    sess->worker = w;
     sess->request = NULL;
     sess->forward = NULL;
     sess->upstream = NULL;
+    sess->relay = NULL;
+    sess->norelay = 0;
+    sess->token[0] = '\0';
+    sess->ustart = 0;
+    sess->uconnected = 0;
+    sess->probe = NULL;
+    sess->probe_data = NULL;
     rps_addr_init(&sess->remote);
     gettimeofday(&sess->start, NULL);
 }
 
+/* Check client credentials, take the session token off the username */
+bool
+server_sess_auth(rps_sess_t *sess, const char *uname, const char *passwd) {
+    struct config_server *cfg;
+    const char *token;
+    size_t len;
+
+    cfg = sess->server->cfg;
+
+    if (rps_strcmp(&cfg->password, passwd) != 0) {
+        return false;
+    }
+
+    if (rps_strcmp(&cfg->username, uname) == 0) {
+        return true;
+    }
+
+    len = strlen(SESSION_TOKEN_PREFIX);
+
+    if (strncmp(uname, (const char *)cfg->username.data, cfg->username.len) != 0 ||
+            strncmp(uname + cfg->username.len, SESSION_TOKEN_PREFIX, len) != 0) {
+        return false;
+    }
+
+    token = uname + cfg->username.len + len;
+    len = strlen(token);
+    /* not cut, tokens sharing a prefix would stick to the same upstream */
+    if (len == 0 || len > SESSION_TOKEN_MAX_LEN) {
+        log_verb("session token of %zu bytes rejected, want 1 to %d", 
+                len, SESSION_TOKEN_MAX_LEN);
+        return false;
+    }
+
+    memcpy(sess->token, token, len);
+    sess->token[len] = '\0';
+
+    return true;
+}
+
+/* Key of chash scheduling, see upstream_hash_key */
+static size_t
+server_sess_hash_key(rps_sess_t *sess, char *key) {
+    switch (sess->server->upstreams->hash_key) {
+    case up_hash_session:
+        if (sess->token[0] != '\0') {
+            strcpy(key, sess->token);
+            break;
+        }
+        /* fall through */
+    case up_hash_client:
+        strcpy(key, sess->request->peername);
+        break;
+    case up_hash_remote:
+        if (rps_unresolve_addr(&sess->remote, key) != RPS_OK) {
+            return 0;
+        }
+        break;
+    default:
+        NOT_REACHED();
+    }
+
+    return strlen(key);
+}
+
 static void
 server_sess_upstream_mark_fail(rps_sess_t *sess) {
     rps_ctx_t *request, *forward;
@@ -79,7 +416,7 @@ server_sess_upstream_mark_fail(rps_sess_t *sess) {
         return;
     }
 
-    sess->upstream->failure += 1;
+    upstream_mark_failure(sess->upstream);
 
     request = sess->request;
     forward = sess->forward;
@@ -134,7 +471,7 @@ server_sess_mark_success(rps_sess_t *sess) {
     request = sess->request;
     forward = sess->forward;
 
-    sess->upstream->success += 1;
+    upstream_mark_success(sess->upstream);
 
     gettimeofday (&sess->end, NULL);
     elapsed = (sess->end.tv_sec - sess->start.tv_sec) + 
@@ -152,13 +489,17 @@ server_sess_mark_success(rps_sess_t *sess) {
 
 static void
 server_sess_free(rps_sess_t *sess) {
+    struct worker *w;
+
+    w = sess->worker;
+
     if (((sess->request != NULL)) && (sess->request->state & c_closed)) {
-        rps_free(sess->request);
+        server_ctx_put(w, sess->request);
         sess->request = NULL;
     }
 
     if ((sess->forward != NULL) && (sess->forward->state & c_closed)) {
-        rps_free(sess->forward);
+        server_ctx_put(w, sess->forward);
         sess->forward = NULL;
     }
 
@@ -167,7 +508,7 @@ server_sess_free(rps_sess_t *sess) {
     }
 
     sess->upstream = NULL;
-    rps_free(sess);
+    server_sess_put(w, sess);
 }
 
 static rps_status_t
@@ -176,15 +517,23 @@ server_ctx_init(rps_ctx_t *ctx, rps_sess_t *sess, uint8_t flag, uint32_t timeout
     ctx->flag = flag;
     ctx->state = c_init;
     ctx->stream = -1;
+    ctx->rbuf = NULL;
     ctx->nread = 0;
-    ctx->nwrite = 0;
-    ctx->nwrite2 = 0;
+    ctx->rmbuf = NULL;
+    ctx->rsize = READ_BUF_SIZE;
+    ctx->whead = NULL;
+    ctx->wtail = NULL;
+    ctx->wpending = 0;
+    ctx->wnbuf = 0;
+    ctx->wflight = 0;
+    ctx->wnext = NULL;
+    ctx->wqueued = 0;
     ctx->reconn = 0;
     ctx->retry = 0;
     ctx->connecting = 0;
     ctx->connected = 0;
     ctx->established = 0;
-    ctx->c_count = 0;
+    ctx->paused = 0;
     ctx->proto = UNSET;
     ctx->reply_code = rps_rep_undefined;
     ctx->rstat = c_stop;
@@ -192,22 +541,10 @@ server_ctx_init(rps_ctx_t *ctx, rps_sess_t *sess, uint8_t flag, uint32_t timeout
     ctx->timeout = timeout;
     ctx->handle.handle.data  = ctx;
     ctx->write_req.data = ctx;
-    ctx->timer.data = ctx;
+    wheel_node_init(&ctx->timer, timeout, ctx);
     ctx->connect_req.data = ctx;
     ctx->shutdown_req.data = ctx;
 
-    ctx->wbuf = (char *)rps_alloc(WRITE_BUF_SIZE);
-    if (ctx->wbuf == NULL) {
-        return RPS_ENOMEM;
-    }
-    
-    ctx->wbuf2 = (char *)rps_alloc(WRITE_BUF_SIZE);
-    if (ctx->wbuf2 == NULL) {
-        rps_free(ctx->wbuf);
-        ctx->wbuf = NULL;
-        return RPS_ENOMEM;
-    }
-
     ctx->req = NULL;
     ctx->do_next = NULL;
 
@@ -261,6 +598,32 @@ server_ctx_set_proto(rps_ctx_t *ctx, rps_proto_t proto) {
 }
 
 
+/* Give read and write chunks back to the worker pool, handle must not be using them */
+static void
+server_ctx_free_bufs(rps_ctx_t *ctx) {
+    struct mbuf *mb;
+
+    if (ctx->rmbuf != NULL) {
+        mbuf_put(ctx->rmbuf);
+        ctx->rmbuf = NULL;
+    }
+    ctx->rbuf = NULL;
+
+    while (ctx->whead != NULL) {
+        mb = ctx->whead;
+        ctx->whead = mb->next;
+        mbuf_put(mb);
+    }
+
+    ctx->wtail = NULL;
+    ctx->wpending = 0;
+    ctx->wnbuf = 0;
+    ctx->wflight = 0;
+}
+
+static void server_flush_cancel(rps_ctx_t *ctx);
+static rps_status_t server_flush_now(rps_ctx_t *ctx);
+
 static void
 server_ctx_deinit(rps_ctx_t *ctx) {
 
@@ -270,7 +633,9 @@ server_ctx_deinit(rps_ctx_t *ctx) {
     ctx->connecting = 0;
     ctx->connected = 0;
     ctx->established = 0;
-    ctx->c_count = 0;
+
+    wheel_del(&ctx->sess->worker->wheel, &ctx->timer);
+    server_flush_cancel(ctx);
 
     ctx->handle.handle.data  = NULL;
     ctx->write_req.data = NULL;
@@ -278,8 +643,7 @@ server_ctx_deinit(rps_ctx_t *ctx) {
     ctx->connect_req.data = NULL;
     ctx->shutdown_req.data = NULL;
 
-    rps_free(ctx->wbuf);
-    rps_free(ctx->wbuf2);
+    server_ctx_free_bufs(ctx);
 
     if (ctx->req != NULL) {
         rps_free(ctx->req);
@@ -311,13 +675,6 @@ server_on_ctx_close(uv_handle_t* handle) {
 
     ctx = handle->data;
 
-    ctx->c_count += 1;
-
-    if (ctx->c_count < 2) {
-        //waitting for both timer and handler closed.
-        return; 
-    }
-    
     switch (ctx->flag) {
         case c_request:
             log_debug("Request from %s:%d be closed", 
@@ -340,6 +697,9 @@ server_on_ctx_close(uv_handle_t* handle) {
 
 
 
+static void server_relay_stop(rps_sess_t *sess);
+static void server_timer_stop(rps_ctx_t *ctx);
+
 static void
 server_ctx_close(rps_ctx_t *ctx) {
 
@@ -347,16 +707,16 @@ server_ctx_close(rps_ctx_t *ctx) {
         return;
     }
 
-    uv_timer_stop(&ctx->timer);
-    uv_close((uv_handle_t *)&ctx->timer, (uv_close_cb)server_on_ctx_close);
+    /* relay polls dups of the context fd, take it down before closing handle */
+    server_relay_stop(ctx->sess);
 
-    if (!ctx->connecting && !ctx->connected) {
-        // we still need guarantee free the memory of context and session 
-        // even if connect didn't established 
-        ctx->c_count += 1;
-        return;
+    if (ctx->connected) {
+        /* last words like error replies were queued in this iteration, best effort */
+        server_flush_now(ctx);
     }
 
+    server_timer_stop(ctx);
+
     ctx->state = c_closing;
 
     // Recycle the allocated resources.
@@ -399,7 +759,12 @@ server_ctx_shutdown(rps_ctx_t *ctx) {
     if (server_ctx_dead(ctx)) {
         return;
     }
-    
+
+    if (server_flush_now(ctx) != RPS_OK) {
+        server_ctx_close(ctx);
+        return;
+    }
+
     err = uv_shutdown(&ctx->shutdown_req, &ctx->handle.stream, server_on_ctx_shutdown);
     if (err) {
         UV_SHOW_ERROR(err, "shutdown");
@@ -415,21 +780,45 @@ server_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
 
     ctx = handle->data;
 
-    buf->base = ctx->rbuf;
-    buf->len = sizeof(ctx->rbuf);
+    /* handshake contexts keep their chunk between reads, reuse it */
+    if (ctx->rmbuf == NULL) {
+        ctx->rmbuf = mbuf_get(&ctx->sess->worker->mbufs, ctx->rsize);
+    }
+
+    if (ctx->rmbuf == NULL) {
+        /* read callback will get UV_ENOBUFS */
+        buf->base = NULL;
+        buf->len = 0;
+        return buf;
+    }
+
+    ctx->rmbuf->pos = ctx->rmbuf->start;
+    ctx->rmbuf->last = ctx->rmbuf->start;
+
+    buf->base = (char *)ctx->rmbuf->last;
+    buf->len = mbuf_room(ctx->rmbuf);
 
     return buf;
 }
 
+static void server_timer_reset(rps_ctx_t *ctx);
+static bool server_relay_active(rps_ctx_t *ctx);
+
 static void 
-server_on_timer_expire(uv_timer_t *handle) {
+server_on_timer_expire(struct wheel_node *node) {
     rps_ctx_t *ctx;
 
-    ctx = handle->data;
+    ctx = node->data;
 
     if (server_ctx_dead(ctx)) {
         return;
     }
+
+    /* traffic redirected in kernel never resets the timer */
+    if (server_relay_active(ctx)) {
+        server_timer_reset(ctx);
+        return;
+    }
     
 
     if (ctx->flag == c_request) {
@@ -448,19 +837,54 @@ server_on_timer_expire(uv_timer_t *handle) {
     server_do_next(ctx);
 }
 
+/* Called on every I/O, only stamps the activity, the wheel re-hashes lazily */
 static void 
 server_timer_reset(rps_ctx_t *ctx) {
-    int err;
+    struct wheel *wh;
 
-    err = uv_timer_start(&ctx->timer, 
-            (uv_timer_cb)server_on_timer_expire, ctx->timeout, 0);
-    if (err) {
-        char why[256];
-        snprintf(why, 256, "reset timer %s", ctx->peername);
-        UV_SHOW_ERROR(err, why);
+    wh = &ctx->sess->worker->wheel;
+
+    wheel_touch(wh, &ctx->timer);
+    if (!wheel_armed(&ctx->timer)) {
+        wheel_add(wh, &ctx->timer);
+    }
+}
+
+static void
+server_timer_stop(rps_ctx_t *ctx) {
+    wheel_del(&ctx->sess->worker->wheel, &ctx->timer);
+}
+
+
+/* 
+ * Established context has forwarded the data, give the chunk back so that idle 
+ * sessions hold no buffer. Handshake contexts keep it, the data may be replayed 
+ * to upstream once established (pipeline tunnel).
+ */
+static void
+server_read_release(rps_ctx_t *ctx) {
+    if ((ctx->state & c_established) && ctx->rmbuf != NULL) {
+        mbuf_put(ctx->rmbuf);
+        ctx->rmbuf = NULL;
+        ctx->rbuf = NULL;
     }
 }
 
+/* Bulk tunnels fill every read, grow the next one. Idle or interactive ones shrink back */
+static void
+server_read_adapt(rps_ctx_t *ctx) {
+    if (!(ctx->state & c_established)) {
+        return;
+    }
+
+    if (mbuf_room(ctx->rmbuf) == 0) {
+        if (ctx->rsize < READ_BUF_MAX) {
+            ctx->rsize <<= 1;
+        }
+    } else if ((size_t)ctx->nread <= ctx->rsize / 4 && ctx->rsize > READ_BUF_SIZE) {
+        ctx->rsize >>= 1;
+    }
+}
 
 static void
 server_on_read_done(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
@@ -473,13 +897,17 @@ server_on_read_done(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
     }
 
     ASSERT(&ctx->handle.stream == stream);
-    if (nread > 0) {
-        ASSERT(ctx->rbuf == buf->base);
-    }
 
     ctx->rstat = c_done;
     ctx->nread = nread;
 
+    if (nread > 0) {
+        ASSERT(ctx->rmbuf != NULL && (char *)ctx->rmbuf->last == buf->base);
+        ctx->rmbuf->last += nread;
+        ctx->rbuf = (char *)ctx->rmbuf->pos;
+        server_read_adapt(ctx);
+    }
+
     if (nread <0 ) {
         
         if (ctx->state & c_established) {
@@ -502,6 +930,7 @@ server_on_read_done(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
 
     /* nread equal 0 is equivalent to EAGAIN or EWOULDBLOCK */
     if (nread == 0) {
+        server_read_release(ctx);
         return;
     }
 
@@ -516,6 +945,8 @@ server_on_read_done(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
     server_timer_reset(ctx);
 
     server_do_next(ctx);
+
+    server_read_release(ctx);
 }
 
 static rps_status_t
@@ -533,102 +964,1013 @@ server_read_start(rps_ctx_t *ctx) {
     return RPS_OK;
 }
 
-/*
 static void
 server_read_stop(rps_ctx_t *ctx) {
     uv_read_stop(&ctx->handle.stream);
     ctx->rstat = c_stop;
 }
-*/
 
-static void
-server_on_write_done(uv_write_t *req, int err) {
-    rps_ctx_t *ctx;
+/* bytes in flight plus bytes waiting for the in-flight write to finish */
+static size_t
+server_write_pending(rps_ctx_t *ctx) {
+    return ctx->wpending;
+}
 
-    if (err == UV_ECANCELED) {
-        return;  /* Handle has been closed. */
-    }
+static void
+server_backpressure_release(rps_ctx_t *ctx) {
+    rps_sess_t *sess;
+    rps_ctx_t *producer;
 
-    ctx = req->data;
+    sess = ctx->sess;
+    producer = ctx->flag == c_request ? sess->forward : sess->request;
 
-    if (server_ctx_dead(ctx)) {
+    if (server_ctx_dead(producer) || !producer->paused) {
         return;
     }
 
-    ctx->wstat = c_done;
+    /* the consumer is still draining, producer isn't idle */
+    server_timer_reset(producer);
 
-    if (err) {
-        char why[256];
-        snprintf(why, 256, "on write to %s", ctx->peername);
-        UV_SHOW_ERROR(err, why);
-        ctx->state = c_kill;
-        server_do_next(ctx);
+    if (server_write_pending(ctx) > WRITE_LOW_WATERMARK) {
         return;
     }
 
-    if (ctx->nwrite2 > 0) {
-        server_write(ctx, ctx->wbuf2, ctx->nwrite2);
-        ctx->nwrite2 = 0;
-    }
+    producer->paused = 0;
 
+    if (server_read_start(producer) != RPS_OK) {
+        producer->state = c_kill;
+        server_do_next(producer);
+    }
 }
 
-rps_status_t
-server_write(rps_ctx_t *ctx, const void *data, size_t len) {
-    int err;
-    uv_buf_t buf;
-    size_t slot;
+#ifdef __linux__
 
-    ASSERT(len > 0);
+#define SPLICE_CHUNK_SIZE   65536 //64k, default pipe capacity
 
-    if (ctx->wstat == c_busy) {
-        slot = WRITE_BUF_SIZE - ctx->nwrite2;
-        if (slot == 0) {
-            log_debug("write buffer to %s has been full, drop %d bytes.", ctx->peername, len);
-            return RPS_OK; 
-        }
+static struct splice_pipe *
+server_pipe_get(struct worker *w) {
+    struct splice_pipe *p;
 
-        len = MIN(slot, len);
+    if (w->pipes != NULL) {
+        p = w->pipes;
+        w->pipes = p->next;
+        w->npipes--;
+        return p;
+    }
 
-        memcpy(&ctx->wbuf2[ctx->nwrite2], data, len);
-        ctx->nwrite2 += len;
-        return RPS_OK;
+    p = (struct splice_pipe *)rps_alloc(sizeof(*p));
+    if (p == NULL) {
+        return NULL;
     }
 
+    if (pipe2(p->fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        log_error("create splice pipe failed: %s", strerror(errno));
+        rps_free(p);
+        return NULL;
+    }
 
-    memcpy(ctx->wbuf, data, len);
-    ctx->nwrite = len;
+    return p;
+}
 
-    buf.base = (char *)ctx->wbuf;
-    buf.len = len;
+static void
+server_pipe_put(struct worker *w, struct splice_pipe *p, bool dirty) {
+    /* pipe still holding data of a dead session can't be reused */
+    if (dirty || w->npipes >= SPLICE_PIPE_POOL_MAX) {
+        close(p->fds[0]);
+        close(p->fds[1]);
+        rps_free(p);
+        return;
+    }
 
-    
-    err = uv_write(&ctx->write_req, 
-             &ctx->handle.stream, 
-             &buf, 
-             1, 
-             server_on_write_done);
+    p->next = w->pipes;
+    w->pipes = p;
+    w->npipes++;
+}
 
-    if (err) {
-        char why[256];
-        snprintf(why, 256, "write to %s", ctx->peername);
-        UV_SHOW_ERROR(err, why);
-        return RPS_ERROR;
-    }
-    
+static void
+server_on_relay_close(uv_handle_t *handle) {
+    struct relay *r;
+    struct relay_end *e;
+    struct epoll_event dummy;
+    int i;
 
-#if RPS_DEBUG_OPEN
-    if (ctx->proto == SOCKS5 && ctx->state < c_established) {
-        log_verb("write %zd bytes", len);
-        log_hex(LOG_VERBOSE, (char *)data, len);
+    r = handle->data;
+
+    r->c_count += 1;
+    if (r->c_count < 2) {
+        //waitting for both polls closed.
+        return;
     }
-#endif
 
-    ctx->wstat = c_busy;
+    for (i = 0; i < 2; i++) {
+        e = &r->ends[i];
+        if (r->engine != tunnel_engine_splice || e->fd < 0) {
+            continue;
+        }
+        /* closed uv_poll leaves the fd in epoll, the original fd may keep the socket open */
+        epoll_ctl(uv_backend_fd(&r->worker->loop), EPOLL_CTL_DEL, e->fd, &dummy);
+        close(e->fd);
+        if (e->pipe != NULL) {
+            server_pipe_put(r->worker, e->pipe, e->npipe > 0);
+        }
+    }
 
-    server_timer_reset(ctx);
-    
-    return RPS_OK;
+    rps_free(r);
+}
+
+static void
+server_relay_stop(rps_sess_t *sess) {
+    struct relay *r;
+
+    r = sess->relay;
+    if (r == NULL) {
+        return;
+    }
+
+    sess->relay = NULL;
+    r->sess = NULL;
+
+    if (r->engine == tunnel_engine_sockmap) {
+        /* context fds are still open here */
+        sockmap_del(&r->worker->sockmap, r->ends[0].fd, r->ends[1].fd);
+        r->c_count = 1;
+        uv_close((uv_handle_t *)&r->timer, server_on_relay_close);
+        return;
+    }
+
+    uv_close((uv_handle_t *)&r->ends[0].poll, server_on_relay_close);
+    uv_close((uv_handle_t *)&r->ends[1].poll, server_on_relay_close);
+}
+
+/* splice bytes from socket of e into its pipe, only called while pipe is empty */
+static rps_status_t
+server_relay_fill(struct relay *r, struct relay_end *e) {
+    ssize_t n;
+
+    if (e->pipe == NULL) {
+        e->pipe = server_pipe_get(r->worker);
+        if (e->pipe == NULL) {
+            return RPS_ERROR;
+        }
+    }
+
+    n = splice(e->fd, NULL, e->pipe->fds[1], NULL, SPLICE_CHUNK_SIZE, 
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return RPS_OK;
+        }
+        log_debug("splice from %s failed: %s", e->ctx->peername, strerror(errno));
+        return RPS_ERROR;
+    }
+
+    if (n == 0) {
+        e->eof = 1;
+        return RPS_OK;
+    }
+
+    e->npipe += (size_t)n;
+
+    server_timer_reset(e->ctx);
+
+    return RPS_OK;
+}
+
+/* splice bytes waiting in pipe of src out to socket of dst */
+static rps_status_t
+server_relay_drain(struct relay *r, struct relay_end *src, struct relay_end *dst) {
+    ssize_t n;
+
+    while (src->npipe > 0) {
+        n = splice(src->pipe->fds[0], NULL, dst->fd, NULL, src->npipe, 
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                break;
+            }
+            log_debug("splice to %s failed: %s", dst->ctx->peername, strerror(errno));
+            return RPS_ERROR;
+        }
+
+        src->npipe -= (size_t)n;
+
+        server_timer_reset(dst->ctx);
+    }
+
+    if (src->npipe == 0 && src->pipe != NULL) {
+        server_pipe_put(r->worker, src->pipe, false);
+        src->pipe = NULL;
+    }
+
+    return RPS_OK;
+}
+
+static void server_on_relay_event(uv_poll_t *handle, int status, int events);
+
+/* read from an end while its pipe is empty, write to it while the other pipe has data */
+static void
+server_relay_update(struct relay *r) {
+    struct relay_end *e, *o;
+    int i, events;
+
+    for (i = 0; i < 2; i++) {
+        e = &r->ends[i];
+        o = &r->ends[1 - i];
+
+        events = 0;
+        if (!e->eof && e->npipe == 0) {
+            events |= UV_READABLE;
+        }
+        if (o->npipe > 0) {
+            events |= UV_WRITABLE;
+        }
+
+        if (events == e->events) {
+            continue;
+        }
+
+        e->events = events;
+
+        if (events == 0) {
+            uv_poll_stop(&e->poll);
+        } else {
+            uv_poll_start(&e->poll, events, server_on_relay_event);
+        }
+    }
+}
+
+static void
+server_on_relay_event(uv_poll_t *handle, int status, int events) {
+    struct relay *r;
+    struct relay_end *e, *o;
+    rps_sess_t *sess;
+    int i;
+
+    r = handle->data;
+    sess = r->sess;
+
+    if (sess == NULL) {
+        return; /* relay has been stopped */
+    }
+
+    e = handle == &r->ends[0].poll ? &r->ends[0] : &r->ends[1];
+    o = e == &r->ends[0] ? &r->ends[1] : &r->ends[0];
+
+    if (status < 0) {
+        UV_SHOW_ERROR(status, "relay poll");
+        goto kill;
+    }
+
+    if (events & UV_WRITABLE) {
+        if (server_relay_drain(r, o, e) != RPS_OK) {
+            goto kill;
+        }
+    }
+
+    if (events & UV_READABLE) {
+        if (server_relay_fill(r, e) != RPS_OK) {
+            goto kill;
+        }
+        /* most of the time the other end is writable, skip a poll round */
+        if (server_relay_drain(r, e, o) != RPS_OK) {
+            e = o;
+            goto kill;
+        }
+    }
+
+    /* Same as server_cycle, EOF from one end closes it and shuts down the other end */
+    for (i = 0; i < 2; i++) {
+        e = &r->ends[i];
+        o = &r->ends[1 - i];
+        if (e->eof && e->npipe == 0) {
+            server_ctx_close(e->ctx);
+            server_ctx_shutdown(o->ctx);
+            server_sess_mark_success(sess);
+            return;
+        }
+    }
+
+    server_relay_update(r);
+    return;
+
+kill:
+    e->ctx->state = c_kill;
+    server_do_next(e->ctx);
+}
+
+static void
+server_splice_start(rps_sess_t *sess) {
+    struct relay *r;
+    struct relay_end *e;
+    uv_os_fd_t fd;
+    int i, n, err;
+
+    r = (struct relay *)rps_alloc(sizeof(*r));
+    if (r == NULL) {
+        return;
+    }
+
+    r->worker = sess->worker;
+    r->sess = sess;
+    r->engine = tunnel_engine_splice;
+    r->c_count = 0;
+
+    n = 0;
+
+    for (i = 0; i < 2; i++) {
+        e = &r->ends[i];
+        e->fd = -1;
+        e->pipe = NULL;
+        e->npipe = 0;
+        e->ctx = i == 0 ? sess->request : sess->forward;
+        e->events = 0;
+        e->eof = 0;
+        e->poll.data = r;
+    }
+
+    /* libuv keeps its own watcher on the context fd, poll a dup of it */
+    for (i = 0; i < 2; i++) {
+        e = &r->ends[i];
+        if (uv_fileno(&e->ctx->handle.handle, &fd) != 0) {
+            goto error;
+        }
+        e->fd = dup(fd);
+        if (e->fd < 0) {
+            log_error("dup %s fd failed: %s", e->ctx->peername, strerror(errno));
+            goto error;
+        }
+    }
+
+    for (n = 0; n < 2; n++) {
+        err = uv_poll_init(&sess->worker->loop, &r->ends[n].poll, r->ends[n].fd);
+        if (err) {
+            UV_SHOW_ERROR(err, "relay poll init");
+            goto error;
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        e = &r->ends[i];
+        server_read_stop(e->ctx);
+        e->ctx->paused = 0;
+    }
+
+    sess->relay = r;
+
+    server_relay_update(r);
+
+    log_debug("Relay tunnel %s:%d <-> %s:%d by splice", 
+            sess->request->peername, rps_unresolve_port(&sess->request->peer),
+            sess->forward->peername, rps_unresolve_port(&sess->forward->peer));
+
+    return;
+
+error:
+    /* stay on copy path */
+    sess->norelay = 1;
+
+    if (n > 0) {
+        r->sess = NULL;
+        r->c_count = 2 - n;
+        for (i = 0; i < n; i++) {
+            uv_close((uv_handle_t *)&r->ends[i].poll, server_on_relay_close);
+        }
+        return;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (r->ends[i].fd >= 0) {
+            close(r->ends[i].fd);
+        }
+    }
+    rps_free(r);
+}
+
+static int
+server_relay_index(struct relay *r, rps_ctx_t *ctx) {
+    return ctx == r->ends[0].ctx ? 0 : 1;
+}
+
+/* Bytes received from src haven't all been acked by the remote of the other end */
+static bool
+server_sockmap_pending(struct relay *r, int src) {
+    uint64_t received, acked, unused;
+    int dst;
+
+    dst = 1 - src;
+
+    if (sockmap_tcp_bytes(r->ends[src].fd, &received, &unused) < 0 || 
+            sockmap_tcp_bytes(r->ends[dst].fd, &unused, &acked) < 0) {
+        return false;
+    }
+
+    return acked - r->acked[dst] < received - r->received[src];
+}
+
+static void
+server_on_sockmap_drain(uv_timer_t *handle) {
+    struct relay *r;
+    rps_sess_t *sess;
+    rps_ctx_t *ctx, *endpoint;
+    int i;
+
+    r = handle->data;
+    sess = r->sess;
+
+    if (sess == NULL) {
+        return;
+    }
+
+    ctx = r->eof;
+    i = server_relay_index(r, ctx);
+
+    if (server_sockmap_pending(r, i)) {
+        return;
+    }
+
+    uv_timer_stop(&r->timer);
+
+    endpoint = r->ends[1 - i].ctx;
+
+    server_ctx_close(ctx);
+    server_ctx_shutdown(endpoint);
+    server_sess_mark_success(sess);
+}
+
+/* 
+ * Redirected bytes may be still queued in kernel when EOF arrives, closing now would
+ * drop them. Hold the EOF until the other end has them acked, return false if no need.
+ */
+static bool
+server_relay_eof(rps_ctx_t *ctx) {
+    struct relay *r;
+
+    r = ctx->sess->relay;
+
+    if (r == NULL || r->engine != tunnel_engine_sockmap || r->eof != NULL) {
+        return false;
+    }
+
+    if (!server_sockmap_pending(r, server_relay_index(r, ctx))) {
+        return false;
+    }
+
+    r->eof = ctx;
+    server_read_stop(ctx);
+
+    uv_timer_start(&r->timer, server_on_sockmap_drain, 
+            SOCKMAP_DRAIN_INTERVAL, SOCKMAP_DRAIN_INTERVAL);
+
+    return true;
+}
+
+/* Sockmap traffic bypasses the context timers, tell from tcp counters whether session is idle */
+static bool
+server_relay_active(rps_ctx_t *ctx) {
+    struct relay *r;
+    uint64_t received, acked, total;
+    int i;
+
+    r = ctx->sess->relay;
+
+    if (r == NULL || r->engine != tunnel_engine_sockmap) {
+        return false;
+    }
+
+    total = 0;
+
+    for (i = 0; i < 2; i++) {
+        if (sockmap_tcp_bytes(r->ends[i].fd, &received, &acked) < 0) {
+            return false;
+        }
+        total += received + acked;
+    }
+
+    i = server_relay_index(r, ctx);
+
+    if (total == r->activity[i]) {
+        return false;
+    }
+
+    r->activity[i] = total;
+
+    return true;
+}
+
+static void
+server_sockmap_start(rps_sess_t *sess) {
+    struct worker *w;
+    struct relay *r;
+    struct relay_end *e;
+    uv_os_fd_t fd;
+    int i, nread, nqueue;
+    uint64_t received, acked;
+
+    w = sess->worker;
+
+    if (w->sockmap_failed) {
+        return;
+    }
+
+    if (!w->sockmap_ready) {
+        if (sockmap_init(&w->sockmap) < 0) {
+            log_warn("sockmap unavailable on %s worker %d, tunnels stay on copy path", 
+                    w->name, w->id);
+            w->sockmap_failed = 1;
+            return;
+        }
+        w->sockmap_ready = 1;
+    }
+
+    r = (struct relay *)rps_alloc(sizeof(*r));
+    if (r == NULL) {
+        return;
+    }
+
+    for (i = 0; i < 2; i++) {
+        e = &r->ends[i];
+        e->ctx = i == 0 ? sess->request : sess->forward;
+        e->pipe = NULL;
+        e->npipe = 0;
+        e->events = 0;
+        e->eof = 0;
+
+        if (uv_fileno(&e->ctx->handle.handle, &fd) != 0) {
+            goto error;
+        }
+        e->fd = fd;
+
+        /* bytes already received would reach userspace after newer redirected ones, retry later */
+        if (ioctl(fd, FIONREAD, &nread) < 0 || nread > 0) {
+            goto error;
+        }
+
+        if (ioctl(fd, SIOCOUTQ, &nqueue) < 0 || 
+                sockmap_tcp_bytes(fd, &received, &acked) < 0) {
+            goto error;
+        }
+
+        r->received[i] = received;
+        r->acked[i] = acked + (uint64_t)nqueue;
+        r->activity[i] = 0;
+    }
+
+    if (sockmap_add(&w->sockmap, r->ends[0].fd, r->ends[1].fd) < 0) {
+        /* e.g. ipv6 or socket no longer established */
+        sess->norelay = 1;
+        goto error;
+    }
+
+    /* 
+     * Bytes arrived between the check above and the insertion wait in the receive
+     * queue, later ones would overtake them. Empty queues mean none did.
+     */
+    for (i = 0; i < 2; i++) {
+        if (ioctl(r->ends[i].fd, FIONREAD, &nread) < 0 || nread > 0) {
+            break;
+        }
+    }
+
+    if (i < 2) {
+        sockmap_del(&w->sockmap, r->ends[0].fd, r->ends[1].fd);
+        sess->norelay = 1;
+
+        /* safe on copy path only if all received since the check is still queued */
+        for (i = 0; i < 2; i++) {
+            if (ioctl(r->ends[i].fd, FIONREAD, &nread) < 0 ||
+                    sockmap_tcp_bytes(r->ends[i].fd, &received, &acked) < 0 ||
+                    received - r->received[i] != (uint64_t)nread) {
+                break;
+            }
+        }
+
+        rps_free(r);
+
+        if (i < 2) {
+            log_warn("Relay tunnel %s:%d <-> %s:%d reordered while entering sockmap, close it", 
+                    sess->request->peername, rps_unresolve_port(&sess->request->peer),
+                    sess->forward->peername, rps_unresolve_port(&sess->forward->peer));
+            sess->request->state = c_kill;
+            server_do_next(sess->request);
+        }
+        return;
+    }
+
+    r->worker = w;
+    r->sess = sess;
+    r->engine = tunnel_engine_sockmap;
+    r->c_count = 0;
+    r->eof = NULL;
+
+    uv_timer_init(&w->loop, &r->timer);
+    r->timer.data = r;
+
+    sess->relay = r;
+
+    log_debug("Relay tunnel %s:%d <-> %s:%d by sockmap", 
+            sess->request->peername, rps_unresolve_port(&sess->request->peer),
+            sess->forward->peername, rps_unresolve_port(&sess->forward->peer));
+
+    return;
+
+error:
+    rps_free(r);
+}
+
+/* Hand established tunnel over to the kernel once libuv has nothing queued on either side */
+static void
+server_relay_try(rps_sess_t *sess) {
+    rps_ctx_t *request, *forward;
+
+    request = sess->request;
+    forward = sess->forward;
+
+    if (sess->norelay || sess->relay != NULL || sess->server->engine == tunnel_engine_copy) {
+        return;
+    }
+
+    if (server_ctx_dead(request) || server_ctx_dead(forward)) {
+        return;
+    }
+
+    if (request->stream != c_tunnel || 
+            request->state != c_established || forward->state != c_established) {
+        return;
+    }
+
+    if (request->wpending > 0 || forward->wpending > 0) {
+        return;
+    }
+
+    if (sess->server->engine == tunnel_engine_splice) {
+        server_splice_start(sess);
+    } else {
+        server_sockmap_start(sess);
+    }
+}
+
+#else
+
+static void
+server_relay_stop(rps_sess_t *sess) {
+    UNUSED(sess);
+}
+
+static void
+server_relay_try(rps_sess_t *sess) {
+    UNUSED(sess);
+}
+
+static bool
+server_relay_eof(rps_ctx_t *ctx) {
+    UNUSED(ctx);
+    return false;
+}
+
+static bool
+server_relay_active(rps_ctx_t *ctx) {
+    UNUSED(ctx);
+    return false;
+}
+
+#endif
+
+static rps_status_t server_flush(rps_ctx_t *ctx);
+static void server_on_flush(uv_check_t *handle);
+
+static void
+server_on_write_done(uv_write_t *req, int err) {
+    rps_ctx_t *ctx;
+    struct mbuf *mb;
+
+    if (err == UV_ECANCELED) {
+        return;  /* Handle has been closed. */
+    }
+
+    ctx = req->data;
+
+    if (server_ctx_dead(ctx)) {
+        return;
+    }
+
+    ctx->wstat = c_done;
+
+    if (err) {
+        char why[256];
+        snprintf(why, 256, "on write to %s", ctx->peername);
+        UV_SHOW_ERROR(err, why);
+        ctx->state = c_kill;
+        server_do_next(ctx);
+        return;
+    }
+
+    /* release the chunks of finished write */
+    for (; ctx->wflight > 0; ctx->wflight--) {
+        mb = ctx->whead;
+        ctx->whead = mb->next;
+        ctx->wpending -= mbuf_length(mb);
+        ctx->wnbuf--;
+        mbuf_put(mb);
+    }
+
+    if (ctx->whead == NULL) {
+        ctx->wtail = NULL;
+    }
+
+    if (server_flush(ctx) != RPS_OK) {
+        ctx->state = c_kill;
+        server_do_next(ctx);
+        return;
+    }
+
+    server_backpressure_release(ctx);
+
+    server_relay_try(ctx->sess);
+}
+
+/* Drop bytes taken by uv_try_write from the head of the chain */
+static void
+server_write_consume(rps_ctx_t *ctx, size_t n) {
+    struct mbuf *mb;
+    size_t len;
+
+    while (n > 0) {
+        mb = ctx->whead;
+        len = mbuf_length(mb);
+
+        if (n < len) {
+            mb->pos += n;
+            ctx->wpending -= n;
+            break;
+        }
+
+        ctx->whead = mb->next;
+        ctx->wpending -= len;
+        ctx->wnbuf--;
+        n -= len;
+        mbuf_put(mb);
+    }
+
+    if (ctx->whead == NULL) {
+        ctx->wtail = NULL;
+    }
+}
+
+static uint32_t
+server_write_bufs(rps_ctx_t *ctx, uv_buf_t *bufs, size_t *len) {
+    uint32_t n;
+    struct mbuf *mb;
+
+    *len = 0;
+
+    for (n = 0, mb = ctx->whead; mb != NULL && n < WRITE_UV_BUF_SIZE; mb = mb->next, n++) {
+        bufs[n].base = (char *)mb->pos;
+        bufs[n].len = mbuf_length(mb);
+        *len += bufs[n].len;
+    }
+
+    return n;
+}
+
+/*
+ * Write out queued chunks, vectored. The socket is writable most of the time,
+ * uv_try_write hands the bytes to the kernel without a write request,
+ * only what it leaves goes through uv_write.
+ */
+static rps_status_t
+server_flush(rps_ctx_t *ctx) {
+    int err;
+    uint32_t n;
+    size_t len;
+    uv_buf_t bufs[WRITE_UV_BUF_SIZE];
+
+    ASSERT(ctx->wflight == 0);
+
+    for (;;) {
+        n = server_write_bufs(ctx, bufs, &len);
+        if (n == 0) {
+            return RPS_OK;
+        }
+
+        err = uv_try_write(&ctx->handle.stream, bufs, n);
+        if (err == UV_EAGAIN) {
+            break;
+        }
+
+        if (err < 0) {
+            log_debug("try write to %s failed: %s", ctx->peername, uv_strerror(err));
+            return RPS_ERROR;
+        }
+
+        server_write_consume(ctx, (size_t)err);
+        server_timer_reset(ctx);
+
+        if ((size_t)err < len) {
+            /* socket buffer full */
+            break;
+        }
+    }
+
+    n = server_write_bufs(ctx, bufs, &len);
+
+    err = uv_write(&ctx->write_req,
+             &ctx->handle.stream,
+             bufs,
+             n,
+             server_on_write_done);
+
+    if (err) {
+        char why[256];
+        snprintf(why, 256, "write to %s", ctx->peername);
+        UV_SHOW_ERROR(err, why);
+        return RPS_ERROR;
+    }
+
+    ctx->wflight = n;
+    ctx->wstat = c_busy;
+
+    server_timer_reset(ctx);
+
+    return RPS_OK;
+}
+
+/* Flushed by the worker after this loop iteration's callbacks, writes of the iteration coalesce */
+static void
+server_flush_later(rps_ctx_t *ctx) {
+    struct worker *w;
+
+    if (ctx->wqueued || ctx->wflight > 0) {
+        /* in-flight write flushes the rest when done */
+        return;
+    }
+
+    w = ctx->sess->worker;
+
+    if (w->wready == NULL) {
+        uv_check_start(&w->flusher, server_on_flush);
+    }
+
+    ctx->wnext = w->wready;
+    w->wready = ctx;
+    ctx->wqueued = 1;
+}
+
+static void
+server_flush_cancel(rps_ctx_t *ctx) {
+    rps_ctx_t **p;
+
+    if (!ctx->wqueued) {
+        return;
+    }
+
+    for (p = &ctx->sess->worker->wready; *p != NULL; p = &(*p)->wnext) {
+        if (*p == ctx) {
+            *p = ctx->wnext;
+            break;
+        }
+    }
+
+    ctx->wnext = NULL;
+    ctx->wqueued = 0;
+}
+
+/* Flush now, queued output must precede the shutdown */
+static rps_status_t
+server_flush_now(rps_ctx_t *ctx) {
+    if (!ctx->wqueued) {
+        return RPS_OK;
+    }
+
+    server_flush_cancel(ctx);
+
+    return server_flush(ctx);
+}
+
+static void
+server_on_flush(uv_check_t *handle) {
+    struct worker *w;
+    rps_ctx_t *ctx;
+
+    w = handle->data;
+
+    while (w->wready != NULL) {
+        ctx = w->wready;
+        w->wready = ctx->wnext;
+        ctx->wnext = NULL;
+        ctx->wqueued = 0;
+
+        if (server_ctx_dead(ctx) || ctx->wflight > 0) {
+            continue;
+        }
+
+        if (server_flush(ctx) != RPS_OK) {
+            ctx->state = c_kill;
+            server_do_next(ctx);
+            continue;
+        }
+
+        /* output may have gone out without a write request */
+        server_backpressure_release(ctx);
+
+        server_relay_try(ctx->sess);
+    }
+
+    uv_check_stop(&w->flusher);
+}
+
+rps_status_t
+server_write(rps_ctx_t *ctx, const void *data, size_t len) {
+    struct mbuf *mb;
+    const uint8_t *p;
+    size_t n;
+
+    ASSERT(len > 0);
+
+#if RPS_DEBUG_OPEN
+    if (ctx->proto == SOCKS5 && ctx->state < c_established) {
+        log_verb("write %zd bytes", len);
+        log_hex(LOG_VERBOSE, (char *)data, len);
+    }
+#endif
+
+    p = data;
+
+    while (len > 0) {
+        mb = ctx->wtail;
+
+        /* chunks in flight must stay untouched, append to a new one */
+        if (mb == NULL || mbuf_room(mb) == 0 || ctx->wflight == ctx->wnbuf) {
+            /* grow chunk size with the backlog, small replies take small chunks */
+            mb = mbuf_get(&ctx->sess->worker->mbufs, 
+                    MIN(MAX(len, ctx->wpending), WRITE_BUF_SIZE));
+            if (mb == NULL) {
+                log_error("alloc write buffer to %s failed.", ctx->peername);
+                return RPS_ENOMEM;
+            }
+
+            if (ctx->wtail == NULL) {
+                ctx->whead = mb;
+            } else {
+                ctx->wtail->next = mb;
+            }
+            ctx->wtail = mb;
+            ctx->wnbuf++;
+        }
+
+        n = MIN(len, mbuf_room(mb));
+        memcpy(mb->last, p, n);
+        mb->last += n;
+        ctx->wpending += n;
+        p += n;
+        len -= n;
+    }
+
+    server_flush_later(ctx);
+
+    return RPS_OK;
+}
+
+/* 
+ * Queue a chunk on the output chain without copying, the reference is taken over 
+ * and returned to the pool once the write finished.
+ */
+static rps_status_t
+server_write_mbuf(rps_ctx_t *ctx, struct mbuf *mb) {
+    size_t len;
+    struct mbuf *tail;
+
+    len = mbuf_length(mb);
+    tail = ctx->wtail;
+
+    ASSERT(len > 0);
+
+    /* small piece, cheaper to copy than to hold a whole chunk for it */
+    if (len <= WRITE_COPY_MAX && tail != NULL && 
+            ctx->wflight < ctx->wnbuf && mbuf_room(tail) >= len) {
+        memcpy(tail->last, mb->pos, len);
+        tail->last += len;
+        ctx->wpending += len;
+        mbuf_put(mb);
+        return RPS_OK;
+    }
+
+    mb->next = NULL;
+
+    if (tail == NULL) {
+        ctx->whead = mb;
+    } else {
+        tail->next = mb;
+    }
+    ctx->wtail = mb;
+    ctx->wnbuf++;
+    ctx->wpending += len;
+
+    server_flush_later(ctx);
+
+    return RPS_OK;
 }
 
 static void
@@ -657,7 +1999,7 @@ server_on_connect_done(uv_connect_t *req, int err) {
     //ctx->connecting = 0;
 
     /* request maybe killed before forward connected. */
-    if (ctx->flag == c_forward && server_ctx_dead(ctx->sess->request)) {
+    if (ctx->flag == c_forward && ctx->sess->probe == NULL && server_ctx_dead(ctx->sess->request)) {
         ctx->state = c_kill;
     }
 
@@ -672,9 +2014,6 @@ server_connect(rps_ctx_t *ctx) {
     ASSERT(!ctx->connected);
     ASSERT(!ctx->connecting);
 
-    //uv_tcp_init must be called before call uv_tcp_connect each time.
-    uv_tcp_init(&ctx->sess->server->loop, &ctx->handle.tcp);
-
     err = uv_tcp_connect(&ctx->connect_req, 
             &ctx->handle.tcp, 
             (const struct sockaddr *)&ctx->peer.addr,
@@ -684,6 +2023,8 @@ server_connect(rps_ctx_t *ctx) {
         char why[256];
         snprintf(why, 256, "tcp connect %s", ctx->peername);
         UV_SHOW_ERROR(err, why);
+        /* socket may have been opened, let reconnect recycle the handle */
+        ctx->connecting = 1;
         return RPS_ERROR;
     }
 
@@ -703,49 +2044,48 @@ server_connect(rps_ctx_t *ctx) {
  *  |  ---          session          ---   |
  */
 
-static void
-server_on_request_connect(uv_stream_t *us, int err) {
-    struct server *s;
+/* New session with its request context, handle initialized but not opened yet */
+static rps_ctx_t *
+server_request_new(struct worker *w, struct server *s) {
     rps_sess_t *sess;
     rps_ctx_t *request; /* client -> rps */
-    int len;
     rps_status_t status;
 
-    if (err) {
-        UV_SHOW_ERROR(err, "on new connect");
-        return;
-    }
-
-    s = (struct server*)us->data;
-    
-    sess = (struct session*)rps_alloc(sizeof(struct session));
+    sess = server_sess_get(w);
     if (sess == NULL) {
-        return;
+        return NULL;
     }
-    server_sess_init(sess, s);
+    server_sess_init(sess, w, s);
 
-    request = (struct context *)rps_alloc(sizeof(struct context));
+    request = server_ctx_get(w);
     if (request == NULL) {
-        rps_free(sess);
-        return;
+        server_sess_put(w, sess);
+        return NULL;
     }
     sess->request = request;
     status = server_ctx_init(request, sess, c_request, s->rtimeout);
     if (status != RPS_OK) {
-        rps_free(sess);
-        return;
+        server_ctx_put(w, request);
+        server_sess_put(w, sess);
+        return NULL;
     }
 
     server_ctx_set_proto(request, s->proto);
     
-    uv_tcp_init(&s->loop, &request->handle.tcp);
-    uv_timer_init(&s->loop, &request->timer);
+    uv_tcp_init(&w->loop, &request->handle.tcp);
 
-    err = uv_accept(us, &request->handle.stream);
-    if (err) {
-        UV_SHOW_ERROR(err, "accept");
-        goto error;
-    }
+    return request;
+}
+
+/* Request handle holds the client connection, start the handshake */
+static void
+server_request_start(rps_ctx_t *request) {
+    struct server *s;
+    int len;
+    int err;
+    rps_status_t status;
+
+    s = request->sess->server;
 
     request->connecting = 1;
     request->connected = 1;
@@ -782,6 +2122,9 @@ server_on_request_connect(uv_stream_t *us, int err) {
 
     request->state = c_handshake_req;
 
+    /* client that never speaks must time out too */
+    server_timer_reset(request);
+
     /*
      * Beigin receive data
      */
@@ -797,6 +2140,217 @@ error:
     return;
 }
 
+static void
+server_on_request_connect(uv_stream_t *us, int err) {
+    struct worker *w;
+    rps_ctx_t *request;
+
+    if (err) {
+        UV_SHOW_ERROR(err, "on new connect");
+        return;
+    }
+
+    w = (struct worker *)us->data;
+
+    request = server_request_new(w, w->server);
+    if (request == NULL) {
+        return;
+    }
+
+    err = uv_accept(us, &request->handle.stream);
+    if (err) {
+        UV_SHOW_ERROR(err, "accept");
+        server_close(request->sess);
+        return;
+    }
+
+    server_request_start(request);
+}
+
+/* Pool worker adopts the connection accepted by the acceptor of listener s */
+static void
+server_request_open(struct worker *w, struct server *s, uv_os_sock_t fd) {
+    rps_ctx_t *request;
+    int err;
+
+    request = server_request_new(w, s);
+    if (request == NULL) {
+        close(fd);
+        return;
+    }
+
+    err = uv_tcp_open(&request->handle.tcp, fd);
+    if (err) {
+        UV_SHOW_ERROR(err, "tcp open");
+        close(fd);
+        server_close(request->sess);
+        return;
+    }
+
+    server_request_start(request);
+}
+
+static void
+server_on_handoff(uv_async_t *handle) {
+    struct worker *w;
+    struct handoff *h, *next, *list;
+
+    w = handle->data;
+
+    h = __atomic_exchange_n(&w->inbox, NULL, __ATOMIC_ACQUIRE);
+
+    /* inbox is a stack, reverse it to open in arrival order */
+    list = NULL;
+    while (h != NULL) {
+        next = h->next;
+        h->next = list;
+        list = h;
+        h = next;
+    }
+
+    while (list != NULL) {
+        h = list;
+        list = h->next;
+
+        server_request_open(w, h->server, h->fd);
+        /* counted as session now, drop the handoff only after */
+        __atomic_sub_fetch(&w->nhandoff, 1, __ATOMIC_RELAXED);
+
+        rps_free(h);
+    }
+}
+
+/* Least loaded pool worker, ties go round robin from the listener's cursor */
+static struct worker *
+server_pool_pick(struct server *s) {
+    struct worker *w, *best;
+    uint32_t i, n, load, min;
+
+    n = array_n(&s->pool->workers);
+    best = NULL;
+    min = UINT32_MAX;
+
+    for (i = 0; i < n; i++) {
+        w = (struct worker *)array_get(&s->pool->workers, (s->cursor + i) % n);
+        load = __atomic_load_n(&w->nsess, __ATOMIC_RELAXED) + 
+            __atomic_load_n(&w->nhandoff, __ATOMIC_RELAXED);
+        if (load < min) {
+            min = load;
+            best = w;
+        }
+    }
+
+    s->cursor = (s->cursor + 1) % n;
+
+    return best;
+}
+
+static void
+server_handoff(struct server *s, uv_os_sock_t fd) {
+    struct worker *w;
+    struct handoff *h;
+
+    h = (struct handoff *)rps_alloc(sizeof(*h));
+    if (h == NULL) {
+        close(fd);
+        return;
+    }
+
+    w = server_pool_pick(s);
+
+    h->server = s;
+    h->fd = fd;
+
+    __atomic_add_fetch(&w->nhandoff, 1, __ATOMIC_RELAXED);
+
+    /* multiple acceptors push, only the worker takes, and it takes all at once */
+    h->next = __atomic_load_n(&w->inbox, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&w->inbox, &h->next, h, 1, 
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        continue;
+    }
+
+    uv_async_send(&w->async);
+}
+
+static void server_on_acceptor_event(uv_poll_t *handle, int status, int events);
+
+static void
+server_on_acceptor_resume(uv_timer_t *handle) {
+    struct server *s;
+    int err;
+
+    s = handle->data;
+
+    err = uv_poll_start(&s->acceptor, UV_READABLE, server_on_acceptor_event);
+    if (err) {
+        UV_SHOW_ERROR(err, "acceptor poll start");
+    }
+}
+
+/* Nonblocking and close on exec, the workers' loops take it over */
+static uv_os_sock_t
+server_accept(uv_os_sock_t lfd) {
+#ifdef __linux__
+    return accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    uv_os_sock_t fd;
+
+    fd = accept(lfd, NULL, NULL);
+    if (fd < 0) {
+        return fd;
+    }
+
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 || 
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+#endif
+}
+
+static void
+server_on_acceptor_event(uv_poll_t *handle, int status, int events) {
+    struct server *s;
+    uv_os_sock_t fd;
+    int i;
+
+    UNUSED(events);
+
+    s = handle->data;
+
+    if (status) {
+        UV_SHOW_ERROR(status, "acceptor poll");
+        return;
+    }
+
+    for (i = 0; i < ACCEPTOR_BATCH; i++) {
+        fd = server_accept(s->fd);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                /* the backlog stays readable, polling on would spin until fds are freed */
+                log_error("accept on %s:%d failed: %s, pause %d ms", 
+                        s->cfg->listen.data, s->cfg->port, strerror(errno), ACCEPTOR_BACKOFF);
+                uv_poll_stop(&s->acceptor);
+                uv_timer_start(&s->backoff, server_on_acceptor_resume, ACCEPTOR_BACKOFF, 0);
+                break;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_error("accept on %s:%d failed: %s", 
+                        s->cfg->listen.data, s->cfg->port, strerror(errno));
+            }
+            break;
+        }
+
+        server_handoff(s, fd);
+    }
+}
+
 static void
 server_switch(rps_sess_t *sess) {
     struct server *s;
@@ -815,7 +2369,7 @@ server_switch(rps_sess_t *sess) {
     /* request stop read, wait for upstream establishment finished */
     // server_read_stop(request);
 
-    forward = (struct context *)rps_alloc(sizeof(struct context));
+    forward = server_ctx_get(sess->worker);
     if (forward == NULL) {
         request->state = c_kill;
         server_do_next(request);
@@ -823,13 +2377,15 @@ server_switch(rps_sess_t *sess) {
     }
 
     if (server_ctx_init(forward, sess, c_forward,  s->ftimeout) != RPS_OK) {
+        server_ctx_put(sess->worker, forward);
         request->state = c_kill;
         server_do_next(request);
         return;
     }
     sess->forward = forward;
     
-    uv_timer_init(&s->loop, &forward->timer);
+    /* handle lives as long as the context, closing always goes through uv_close */
+    uv_tcp_init(&sess->worker->loop, &forward->handle.tcp);
 
     /*
      *  conext switch from reuqest to forward 
@@ -850,6 +2406,14 @@ server_on_forward_close(uv_handle_t* handle) {
     forward->connected = 0;
     forward->established = 0;
 
+    //uv_tcp_init must be called before call uv_tcp_connect each time.
+    uv_tcp_init(&forward->sess->worker->loop, &forward->handle.tcp);
+    forward->state = c_conn;
+
+    /* output queued for the failed upstream is meaningless to the next one */
+    server_ctx_free_bufs(forward);
+    forward->wstat = c_stop;
+
     /* request context may have been free during server_forward_reconn called */
     if (request == NULL) {
         server_ctx_close(forward);
@@ -858,7 +2422,6 @@ server_on_forward_close(uv_handle_t* handle) {
 
     server_sess_upstream_mark_fail(forward->sess);
 
-    forward->state = c_conn;
     server_do_next(forward);
     return;
 }
@@ -885,7 +2448,7 @@ server_forward_reconn(rps_ctx_t *forward) {
     forward->state = c_closing;
 
     uv_read_stop(&forward->handle.stream);
-    uv_timer_stop(&forward->timer);
+    server_timer_stop(forward);
     uv_close(&forward->handle.handle, server_on_forward_close);
     return;
 
@@ -898,6 +2461,8 @@ static void
 server_forward_connect(rps_ctx_t *forward) {
     struct server *s;
     struct session *sess;
+    char key[MAX_HOSTNAME_LEN + 16];
+    size_t len;
 
     s = forward->sess->server;
     sess = forward->sess;
@@ -912,6 +2477,9 @@ server_forward_connect(rps_ctx_t *forward) {
         if (forward->connected) {
             server_ctx_set_proto(forward, sess->upstream->proto);
 
+            sess->uconnected = uv_hrtime();
+            upstream_mark_connect(sess->upstream, (sess->uconnected - sess->ustart) / 1000);
+
             /* Connect success */
             log_debug("Connect upstream %s://%s:%d success", rps_proto_str(forward->proto), forward->peername, 
                     rps_unresolve_port(&forward->peer));
@@ -930,7 +2498,16 @@ server_forward_connect(rps_ctx_t *forward) {
         goto reconn;
     }
 
-    sess->upstream = upstreams_get(s->upstreams, sess->request->proto);
+    if (s->upstreams->schedule == up_chash) {
+        len = server_sess_hash_key(sess, key);
+        if (forward->retry + forward->reconn > 0) {
+            /* the sticky upstream failed, stick to another one */
+            len += sprintf(key + len, "#%d", forward->retry + forward->reconn);
+        }
+        sess->upstream = upstreams_get(s->upstreams, sess->request->proto, key, len);
+    } else {
+        sess->upstream = upstreams_get(s->upstreams, sess->request->proto, NULL, 0);
+    }
     if (sess->upstream == NULL) {
         log_error("no available %s upstream proxy.", rps_proto_str(sess->request->proto));
         forward->state = c_failed;
@@ -941,6 +2518,8 @@ server_forward_connect(rps_ctx_t *forward) {
 
     memcpy(&forward->peer, &sess->upstream->server, sizeof(sess->upstream->server));
 
+    sess->ustart = uv_hrtime();
+
     if (rps_unresolve_addr(&forward->peer, forward->peername) != RPS_OK) {
         goto reconn;
     }
@@ -1085,6 +2664,8 @@ server_establish_pipeline_tunnel(rps_sess_t *sess) {
 
 static void
 server_establish(rps_sess_t *sess) {
+    upstream_mark_established(sess->upstream, (uv_hrtime() - sess->uconnected) / 1000);
+
     switch (sess->request->stream) {
     case c_tunnel:
         server_establish_tunnel(sess);
@@ -1109,6 +2690,8 @@ server_cycle(rps_ctx_t *ctx) {
     size_t     size;
     rps_sess_t  *sess;
     rps_ctx_t   *endpoint;
+    struct mbuf *mb;
+    rps_status_t status;
 
     data = (uint8_t *)ctx->rbuf;
     size = (size_t)ctx->nread;
@@ -1131,6 +2714,9 @@ server_cycle(rps_ctx_t *ctx) {
     if ((ssize_t)size < 0) {
 
         if ((ssize_t)size == UV_EOF) {
+            if (server_relay_eof(ctx)) {
+                return;
+            }
             server_ctx_close(ctx);
             server_ctx_shutdown(endpoint);
             server_sess_mark_success(sess);
@@ -1141,12 +2727,28 @@ server_cycle(rps_ctx_t *ctx) {
         return;
     }
     
-    if (server_write(endpoint, data, size) != RPS_OK) {
+    if (ctx->rmbuf != NULL) {
+        /* lend the read chunk to endpoint, tunnel bytes are never copied */
+        mb = ctx->rmbuf;
+        ctx->rmbuf = NULL;
+        ctx->rbuf = NULL;
+        status = server_write_mbuf(endpoint, mb);
+    } else {
+        status = server_write(endpoint, data, size);
+    }
+
+    if (status != RPS_OK) {
         ctx->state = c_kill;
         server_do_next(ctx);
         return;
     }
 
+    /* Endpoint can't keep up with us, stop reading until its writes drain */
+    if (server_write_pending(endpoint) > WRITE_HIGH_WATERMARK) {
+        server_read_stop(ctx);
+        ctx->paused = 1;
+    }
+
 #ifdef RPS_DEBUG_OPEN
     log_verb("redirect %d bytes to %s:%d", 
             size, endpoint->peername, rps_unresolve_port(&endpoint->peer));
@@ -1181,9 +2783,15 @@ server_forward_retry(rps_ctx_t *forward) {
     return;
 }
 
+static bool server_probe_next(rps_ctx_t *ctx);
+
 void
 server_do_next(rps_ctx_t *ctx) {
 
+    if (ctx->sess->probe != NULL && server_probe_next(ctx)) {
+        return;
+    }
+
     switch (ctx->state) {
         case c_exchange:
             server_switch(ctx->sess);
@@ -1224,28 +2832,509 @@ server_do_next(rps_ctx_t *ctx) {
 }
 
 
-void 
-server_run(struct server *s) {
+static void
+server_probe_finish(rps_sess_t *sess, bool ok) {
+    server_probe_cb cb;
+
+    cb = sess->probe;
+    sess->probe = NULL;
+
+    if (ok) {
+        upstream_mark_established(sess->upstream, (uv_hrtime() - sess->uconnected) / 1000);
+    }
+
+    /* session is freed once the context closed */
+    server_ctx_close(sess->forward);
+
+    cb(sess->probe_data, sess->upstream, ok);
+}
+
+/* Probe sessions end at the first failure or once established, instead of retrying */
+static bool
+server_probe_next(rps_ctx_t *ctx) {
+    rps_sess_t *sess;
+
+    sess = ctx->sess;
+
+    switch (ctx->state) {
+    case c_conn:
+        if (!ctx->connected) {
+            server_probe_finish(sess, false);
+            return true;
+        }
+
+        server_ctx_set_proto(ctx, sess->upstream->proto);
+
+        sess->uconnected = uv_hrtime();
+        upstream_mark_connect(sess->upstream, (sess->uconnected - sess->ustart) / 1000);
+
+        if (server_read_start(ctx) != RPS_OK) {
+            server_probe_finish(sess, false);
+            return true;
+        }
+
+        if (ctx->proto == HTTP) {
+            /* plain http proxies may refuse CONNECT, request the target through it */
+            if (http_send_probe(ctx) != RPS_OK) {
+                server_probe_finish(sess, false);
+                return true;
+            }
+            ctx->state = c_reply;
+            return true;
+        }
+
+        ctx->state = c_handshake_req;
+        server_do_next(ctx);
+        return true;
+
+    case c_reply:
+        if (ctx->proto != HTTP) {
+            return false;
+        }
+        server_probe_finish(sess, http_probe_verify(ctx));
+        return true;
+
+    case c_establish:
+        server_probe_finish(sess, true);
+        return true;
+
+    case c_retry:
+    case c_failed:
+    case c_kill:
+        server_probe_finish(sess, false);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/* Worker of a probing thread, the caller runs its loop */
+rps_status_t
+server_probe_worker_init(struct worker *w) {
+    if (server_worker_init(w, NULL, 0, WORKER_CPU_UNSET) != RPS_OK) {
+        return RPS_ERROR;
+    }
+
+    w->name = "health";
+
+    wheel_init(&w->wheel, &w->loop, server_on_timer_expire);
+
+    uv_check_init(&w->loop, &w->flusher);
+    w->flusher.data = w;
+    uv_unref((uv_handle_t *)&w->flusher);
+
+    return RPS_OK;
+}
+
+void
+server_probe_worker_deinit(struct worker *w) {
+    server_worker_deinit(w);
+}
+
+/* 
+ * Start probing u, the callback runs on a later loop iteration. 
+ * Returns error without calling back if the probe could not start.
+ */
+rps_status_t
+server_probe(struct worker *w, struct upstream *u, rps_addr_t *target,
+        uint32_t timeout, server_probe_cb cb, void *data) {
+    rps_sess_t *sess;
+    rps_ctx_t *forward;
+
+    sess = server_sess_get(w);
+    if (sess == NULL) {
+        return RPS_ENOMEM;
+    }
+
+    server_sess_init(sess, w, NULL);
+
+    forward = server_ctx_get(w);
+    if (forward == NULL) {
+        server_sess_put(w, sess);
+        return RPS_ENOMEM;
+    }
+
+    server_ctx_init(forward, sess, c_forward, timeout);
+
+    sess->forward = forward;
+    sess->upstream = u;
+    sess->norelay = 1; /* no server, nothing to relay */
+    memcpy(&sess->remote, target, sizeof(*target));
+
+    uv_tcp_init(&w->loop, &forward->handle.tcp);
+
+    memcpy(&forward->peer, &u->server, sizeof(u->server));
+    rps_unresolve_addr(&forward->peer, forward->peername);
+    forward->state = c_conn;
+
+    sess->ustart = uv_hrtime();
+
+    if (server_connect(forward) != RPS_OK) {
+        server_ctx_close(forward);
+        return RPS_ERROR;
+    }
+
+    sess->probe = cb;
+    sess->probe_data = data;
+
+    return RPS_OK;
+}
+
+static rps_status_t
+server_listen(struct worker *w) {
     int err;
+    uv_os_fd_t fd;
+    struct server *s;
+#ifdef SO_REUSEPORT
+    int on;
+#endif
 
-    /* wait for upstreams load success */
-    uv_mutex_lock(&s->upstreams->mutex);
-    uv_cond_wait(&s->upstreams->ready, &s->upstreams->mutex);
-    uv_mutex_unlock(&s->upstreams->mutex);
+    s = w->server;
+
+    err = uv_tcp_init_ex(&w->loop, &w->us, s->listen.family);
+    if (err) {
+        UV_SHOW_ERROR(err, "tcp init");
+        return RPS_ERROR;
+    }
+
+    w->us.data = w;
+
+    if (array_n(&s->workers) > 1) {
+#ifdef SO_REUSEPORT
+        err = uv_fileno((uv_handle_t *)&w->us, &fd);
+        if (err) {
+            UV_SHOW_ERROR(err, "fileno");
+            return RPS_ERROR;
+        }
+
+        on = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            log_error("set SO_REUSEPORT on %s:%d failed: %s", 
+                    s->cfg->listen.data, s->cfg->port, strerror(errno));
+            return RPS_ERROR;
+        }
+#else
+        UNUSED(fd);
+        log_error("multiple workers require SO_REUSEPORT support");
+        return RPS_ERROR;
+#endif
+    }
 
-    err = uv_tcp_bind(&s->us, (struct sockaddr *)&s->listen.addr, 0);
+    err = uv_tcp_bind(&w->us, (struct sockaddr *)&s->listen.addr, 0);
     if (err) {
         UV_SHOW_ERROR(err, "bind");
-        exit(1);
+        return RPS_ERROR;
     }
     
-    err = uv_listen((uv_stream_t*)&s->us, TCP_BACKLOG, server_on_request_connect);
+    err = uv_listen((uv_stream_t*)&w->us, TCP_BACKLOG, server_on_request_connect);
     if (err) {
         UV_SHOW_ERROR(err, "listen");
-        exit(1);
+        return RPS_ERROR;
     }
 
-    log_notice("%s proxy run on %s:%d", s->cfg->proto.data, s->cfg->listen.data, s->cfg->port);
+    return RPS_OK;
+}
+
+/* Handoff mode listen socket, accepted by the acceptor loop itself */
+static rps_status_t
+server_acceptor_listen(struct server *s) {
+    int err;
+    int on;
+
+    s->fd = socket(s->listen.family, SOCK_STREAM, 0);
+    if (s->fd < 0) {
+        log_error("socket for %s:%d failed: %s", 
+                s->cfg->listen.data, s->cfg->port, strerror(errno));
+        return RPS_ERROR;
+    }
+
+    on = 1;
+    if (setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+        log_error("set SO_REUSEADDR on %s:%d failed: %s", 
+                s->cfg->listen.data, s->cfg->port, strerror(errno));
+        return RPS_ERROR;
+    }
+
+    if (bind(s->fd, (struct sockaddr *)&s->listen.addr, s->listen.addrlen) < 0) {
+        log_error("bind %s:%d failed: %s", 
+                s->cfg->listen.data, s->cfg->port, strerror(errno));
+        return RPS_ERROR;
+    }
+
+    if (listen(s->fd, TCP_BACKLOG) < 0) {
+        log_error("listen %s:%d failed: %s", 
+                s->cfg->listen.data, s->cfg->port, strerror(errno));
+        return RPS_ERROR;
+    }
+
+    /* set nonblocking, accept loop stops at EAGAIN */
+    err = uv_poll_init_socket(&s->loop, &s->acceptor, s->fd);
+    if (err) {
+        UV_SHOW_ERROR(err, "acceptor poll init");
+        return RPS_ERROR;
+    }
+
+    s->acceptor.data = s;
+
+    uv_timer_init(&s->loop, &s->backoff);
+    s->backoff.data = s;
+
+    err = uv_poll_start(&s->acceptor, UV_READABLE, server_on_acceptor_event);
+    if (err) {
+        UV_SHOW_ERROR(err, "acceptor poll start");
+        return RPS_ERROR;
+    }
+
+    return RPS_OK;
+}
+
+/*
+ * Steer new connections to the worker pinned on the cpu that handled the SYN. Socket
+ * index equals worker id, the program maps each pinned cpu to its first worker and
+ * spreads cpus without a worker by cpu % workers.
+ */
+static void
+server_attach_cbpf(struct server *s) {
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    struct worker *w;
+    uv_os_fd_t fd;
+    struct sock_filter code[2 * SERVER_MAX_WORKERS + 3];
+    struct sock_fprog prog;
+    uint32_t i, j, n, len;
+    bool mapped;
+
+    n = array_n(&s->workers);
+    len = 0;
+
+    /* A = raw_smp_processor_id() */
+    code[len++] = (struct sock_filter)
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) };
+
+    for (i = 0; i < n; i++) {
+        w = (struct worker *)array_get(&s->workers, i);
+        if (w->cpu == WORKER_CPU_UNSET) {
+            continue;
+        }
+
+        /* workers sharing a cpu, the first one takes its connections */
+        mapped = false;
+        for (j = 0; j < i; j++) {
+            if (((struct worker *)array_get(&s->workers, j))->cpu == w->cpu) {
+                mapped = true;
+                break;
+            }
+        }
+        if (mapped) {
+            continue;
+        }
+
+        /* if A == cpu return worker id */
+        code[len++] = (struct sock_filter){ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, (uint32_t)w->cpu };
+        code[len++] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, i };
+    }
+
+    /* A = A % workers */
+    code[len++] = (struct sock_filter){ BPF_ALU | BPF_MOD | BPF_K, 0, 0, n };
+    /* return A */
+    code[len++] = (struct sock_filter){ BPF_RET | BPF_A, 0, 0, 0 };
+
+    prog.len = len;
+    prog.filter = code;
+
+    w = (struct worker *)array_get(&s->workers, 0);
+    
+    if (uv_fileno((uv_handle_t *)&w->us, &fd) != 0) {
+        return;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        log_warn("attach reuseport cbpf on %s:%d failed: %s, fallback to kernel hash", 
+                s->cfg->listen.data, s->cfg->port, strerror(errno));
+    }
+#else
+    log_warn("reuseport cbpf unsupported on this platform, fallback to kernel hash");
+    UNUSED(s);
+#endif
+}
+
+static void
+server_on_worker_stats(uv_timer_t *handle) {
+    struct worker *w;
+
+    w = handle->data;
+
+    log_debug("%s worker %d active sessions %d, session hits %llu misses %llu idle %d, "
+            "context hits %llu misses %llu idle %d, mbuf used %d chunks %zu bytes", 
+            w->name, w->id, w->nsess, 
+            (unsigned long long)w->sess_hits, (unsigned long long)w->sess_misses, w->nfree_sess,
+            (unsigned long long)w->ctx_hits, (unsigned long long)w->ctx_misses, w->nfree_ctx,
+            w->mbufs.nused, w->mbufs.bused);
+}
+
+static void
+server_worker_run(struct worker *w) {
+#ifdef __linux__
+    cpu_set_t set;
+    int err;
+
+    if (w->cpu != WORKER_CPU_UNSET) {
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err) {
+            log_warn("pin %s worker %d to cpu %d failed: %s", 
+                    w->name, w->id, w->cpu, strerror(err));
+        }
+    }
+#endif
+
+    uv_timer_init(&w->loop, &w->stats);
+    w->stats.data = w;
+    uv_timer_start(&w->stats, server_on_worker_stats, 
+            WORKER_STATS_INTERVAL, WORKER_STATS_INTERVAL);
+    uv_unref((uv_handle_t *)&w->stats);
 
-    uv_run(&s->loop, UV_RUN_DEFAULT);
+    wheel_init(&w->wheel, &w->loop, server_on_timer_expire);
+
+    uv_check_init(&w->loop, &w->flusher);
+    w->flusher.data = w;
+    uv_unref((uv_handle_t *)&w->flusher);
+
+    uv_run(&w->loop, UV_RUN_DEFAULT);
+}
+
+void 
+server_run(struct server *s) {
+    uint32_t i, n;
+    struct worker *w;
+
+    /* wait for upstreams load success */
+    uv_mutex_lock(&s->upstreams->mutex);
+    while (!s->upstreams->once) {
+        uv_cond_wait(&s->upstreams->ready, &s->upstreams->mutex);
+    }
+    uv_mutex_unlock(&s->upstreams->mutex);
+
+    if (s->pool != NULL) {
+        if (server_acceptor_listen(s) != RPS_OK) {
+            exit(1);
+        }
+
+        log_notice("%s proxy run on %s:%d, connections handed off to %d pool workers", 
+                s->cfg->proto.data, s->cfg->listen.data, s->cfg->port, 
+                array_n(&s->pool->workers));
+
+        uv_run(&s->loop, UV_RUN_DEFAULT);
+        return;
+    }
+
+    n = array_n(&s->workers);
+
+    /* Bind in worker order, reuseport group index must match worker id for cbpf steering */
+    for (i = 0; i < n; i++) {
+        w = (struct worker *)array_get(&s->workers, i);
+        if (server_listen(w) != RPS_OK) {
+            exit(1);
+        }
+    }
+
+    if (n > 1 && s->cfg->reuseport_cbpf) {
+        server_attach_cbpf(s);
+    }
+
+    log_notice("%s proxy run on %s:%d with %d workers", 
+            s->cfg->proto.data, s->cfg->listen.data, s->cfg->port, n);
+
+    log_info("%s proxy session footprint %zu bytes, buffers borrowed from worker pool on demand " 
+            "(read %d to %d bytes, write up to %d bytes per chunk)", s->cfg->proto.data, 
+            sizeof(struct session) + 2 * sizeof(struct context), READ_BUF_SIZE, READ_BUF_MAX, 
+            WRITE_BUF_SIZE);
+
+    for (i = 1; i < n; i++) {
+        w = (struct worker *)array_get(&s->workers, i);
+        uv_thread_create(&w->tid, (uv_thread_cb)server_worker_run, w);
+    }
+
+    server_worker_run((struct worker *)array_get(&s->workers, 0));
+
+    for (i = 1; i < n; i++) {
+        w = (struct worker *)array_get(&s->workers, i);
+        uv_thread_join(&w->tid);
+    }
+}
+
+rps_status_t
+server_pool_init(struct worker_pool *pool, struct config_servers *cfg) {
+    int status;
+    int cpus[SERVER_MAX_WORKERS];
+    int ncpu;
+    uint32_t i, n;
+    struct worker *w;
+
+    array_null(&pool->workers);
+
+    ncpu = server_parse_affinity(&cfg->cpu_affinity, cpus, SERVER_MAX_WORKERS);
+    if (ncpu < 0) {
+        log_error("invalid cpu affinity: %s", cfg->cpu_affinity.data);
+        return RPS_ERROR;
+    }
+
+    n = MAX(cfg->workers, 1);
+
+    if (array_init(&pool->workers, n, sizeof(struct worker)) != RPS_OK) {
+        return RPS_ENOMEM;
+    }
+
+    for (i = 0; i < n; i++) {
+        w = (struct worker *)array_push(&pool->workers);
+        status = server_worker_init(w, NULL, i, 
+                ncpu > 0 ? cpus[i % ncpu] : WORKER_CPU_UNSET);
+        if (status != RPS_OK) {
+            array_pop(&pool->workers);
+            server_pool_deinit(pool);
+            return RPS_ERROR;
+        }
+
+        /* keeps the loop alive while no session runs on it */
+        status = uv_async_init(&w->loop, &w->async, server_on_handoff);
+        if (status != 0) {
+            UV_SHOW_ERROR(status, "handoff async init");
+            server_pool_deinit(pool);
+            return RPS_ERROR;
+        }
+        w->async.data = w;
+    }
+
+    return RPS_OK;
+}
+
+void
+server_pool_deinit(struct worker_pool *pool) {
+    while (array_n(&pool->workers)) {
+        server_worker_deinit((struct worker *)array_pop(&pool->workers));
+    }
+    array_deinit(&pool->workers);
+}
+
+void
+server_pool_run(struct worker_pool *pool) {
+    uint32_t i;
+    struct worker *w;
+
+    for (i = 0; i < array_n(&pool->workers); i++) {
+        w = (struct worker *)array_get(&pool->workers, i);
+        uv_thread_create(&w->tid, (uv_thread_cb)server_worker_run, w);
+    }
+
+    log_notice("handoff worker pool run with %d workers", array_n(&pool->workers));
+}
+
+void
+server_pool_wait(struct worker_pool *pool) {
+    uint32_t i;
+
+    for (i = 0; i < array_n(&pool->workers); i++) {
+        uv_thread_join(&((struct worker *)array_get(&pool->workers, i))->tid);
+    }
 }
@@ -6,6 +6,9 @@
 #include "util.h"
 #include "_string.h"
 #include "upstream.h"
+#include "mbuf.h"
+#include "sockmap.h"
+#include "wheel.h"
 
 #include <uv.h>
 
@@ -14,12 +17,143 @@
 #define TCP_BACKLOG  65536
 #define TCP_KEEPALIVE_DELAY 120
 
+#define WORKER_CPU_UNSET    -1
 
-struct server {
-    uv_loop_t               loop;   
+#define SPLICE_PIPE_POOL_MAX    256
+
+/* Max idle sessions and contexts kept by each worker for reuse */
+#define WORKER_FREE_SESS_MAX    1024
+#define WORKER_FREE_CTX_MAX     2048
+
+#define WORKER_STATS_INTERVAL   60000 //ms
+
+/* Max connections accepted by a handoff acceptor per readable event */
+#define ACCEPTOR_BATCH          64
+#define ACCEPTOR_BACKOFF        100 //ms, accepting paused when out of fds
+
+typedef enum {
+    accept_mode_reuseport,  /* every worker listens, kernel balances connections */
+    accept_mode_handoff,    /* one acceptor per listener hands connections to the worker pool */
+} accept_mode_t;
+
+typedef enum {
+    tunnel_engine_copy,     /* bytes go through user space buffers */
+    tunnel_engine_splice,   /* established tunnels relayed by splice(2), linux only */
+    tunnel_engine_sockmap,  /* established tunnels redirected by bpf sockmap, linux only */
+} tunnel_engine_t;
+
+#define SOCKMAP_DRAIN_INTERVAL  10 //ms
+
+struct splice_pipe {
+    int                     fds[2];
+    struct splice_pipe      *next;
+};
+
+/* Accepted connection on its way from an acceptor to a pool worker */
+struct handoff {
+    struct handoff          *next;
+    struct server           *server;
+    uv_os_sock_t            fd;
+};
+
+/*
+ * Each worker owns one event loop running in its own thread.
+ * Listeners with more than one worker bind every worker's socket with SO_REUSEPORT
+ * and let the kernel balance new connections among them.
+ * In handoff mode workers belong to the shared pool and never listen, acceptors push
+ * connections onto the worker's inbox and wake it up by the async handle.
+ */
+struct worker {
+    uv_loop_t               loop;
     uv_tcp_t                us; /* libuv tcp server */
+    uv_thread_t             tid;
+
+    uv_async_t              async;  /* handoff, inbox not empty */
+    struct handoff          *inbox; /* handoff, lock-free stack pushed by acceptors */
+    uint32_t                nhandoff; /* handoff, pushed but not opened yet */
+    uint32_t                nsess;  /* active sessions, read by acceptors */
+
+    struct mbuf_pool        mbufs; /* read and write buffers of the worker's sessions */
+
+    /* closed sessions and contexts waiting for reuse, linked by next */
+    struct session          *free_sess;
+    struct context          *free_ctx;
+    uint32_t                nfree_sess;
+    uint32_t                nfree_ctx;
+    uint64_t                sess_hits;
+    uint64_t                sess_misses;
+    uint64_t                ctx_hits;
+    uint64_t                ctx_misses;
+
+    uv_timer_t              stats;
+
+    struct wheel            wheel; /* context timeouts */
+
+    uv_check_t              flusher; /* flushes written contexts after polling */
+    struct context          *wready; /* contexts with output to flush, linked by wnext */
+
+    struct splice_pipe      *pipes; /* idle pipes lent to splice relays */
+    uint32_t                npipes;
+
+    struct sockmap          sockmap; /* created on first sockmap relay */
+    unsigned                sockmap_ready:1;
+    unsigned                sockmap_failed:1;
+
+    struct server           *server; /* NULL for pool workers */
+    const char              *name;
+
+    uint32_t                id;
+    int                     cpu; /* pinned cpu, WORKER_CPU_UNSET if not pinned */
+};
+
+/* Workers shared by all listeners in handoff mode */
+struct worker_pool {
+    rps_array_t             workers;
+};
+
+/* 
+ * Kernel data path of an established tunnel. 
+ * splice: each end polls a dup of its context fd, bytes read from one end wait in 
+ * its pipe until spliced out to the other end.
+ * sockmap: kernel redirects the bytes, libuv keeps reading for EOF and fallback bytes,
+ * tcp byte counters tell the activity and delivery.
+ */
+struct relay_end {
+    uv_poll_t               poll;
+    int                     fd; /* dup of context fd for splice, context fd for sockmap */
+    struct splice_pipe      *pipe;
+    size_t                  npipe; /* bytes in pipe */
+    struct context          *ctx;
+    int                     events;
+    unsigned                eof:1;
+};
+
+struct relay {
+    struct relay_end        ends[2]; /* request, forward */
+    struct worker           *worker;
+    struct session          *sess; /* NULL once stopped */
+    tunnel_engine_t         engine;
+    uint8_t                 c_count;
+
+    uv_timer_t              timer;       /* sockmap, polls delivery after EOF */
+    struct context          *eof;        /* sockmap, end got EOF */
+    uint64_t                received[2]; /* sockmap, bytes received by each end at start */
+    uint64_t                acked[2];    /* sockmap, bytes acked and queued on each end at start */
+    uint64_t                activity[2]; /* sockmap, session bytes seen by each end's last timeout */
+};
+
+struct server {
+    rps_array_t             workers; /* reuseport mode */
+
+    struct worker_pool      *pool;     /* handoff mode */
+    uv_loop_t               loop;      /* handoff, acceptor loop */
+    uv_poll_t               acceptor;
+    uv_timer_t              backoff;   /* handoff, resumes the acceptor out of fds */
+    uv_os_sock_t            fd;        /* handoff, listen socket */
+    uint32_t                cursor;    /* handoff, first worker probed on ties */
 
     rps_proto_t             proto;
+    tunnel_engine_t         engine;
     
     rps_addr_t              listen;
     
@@ -32,13 +166,31 @@ struct server {
 };
 
 rps_status_t server_init(struct server *s, struct config_server *cs, 
-        struct upstreams *us, uint32_t rtimeout, uint32_t ftimeout);
+        struct upstreams *us, struct worker_pool *pool, uint32_t rtimeout, uint32_t ftimeout);
 void server_deinit(struct server *s);
 void server_run(struct server *s);
+
+rps_status_t server_pool_init(struct worker_pool *pool, struct config_servers *cfg);
+void server_pool_deinit(struct worker_pool *pool);
+void server_pool_run(struct worker_pool *pool);
+void server_pool_wait(struct worker_pool *pool);
 // void server_stop(struct server *);
 
 void server_do_next(rps_ctx_t *ctx);
 
+/* 
+ * Health probe, a session with a forward context only. It connects the upstream and
+ * runs the proxy client handshake up to CONNECT to target, plain http proxies are 
+ * probed by the connect. The callback gets the outcome once, nothing is retried.
+ */
+typedef void (*server_probe_cb)(void *data, struct upstream *u, bool ok);
+
+rps_status_t server_probe_worker_init(struct worker *w);
+void server_probe_worker_deinit(struct worker *w);
+rps_status_t server_probe(struct worker *w, struct upstream *u, rps_addr_t *target,
+        uint32_t timeout, server_probe_cb cb, void *data);
+
 rps_status_t server_write(struct context *ctx, const void *data, size_t len);
+bool server_sess_auth(rps_sess_t *sess, const char *uname, const char *passwd);
 
 #endif
@@ -0,0 +1,370 @@
+/*
+ * Kept apart from core.h, <linux/tcp.h> conflicts with <netinet/tcp.h> pulled in by uv.h.
+ */
+
+#include "sockmap.h"
+#include "log.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef __linux__
+
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/tcp.h>
+
+#define SOCKMAP_LOG_SIZE    4096
+
+struct sockmap_key {
+    uint32_t    remote_ip4;
+    uint32_t    local_ip4;
+    uint32_t    remote_port;    /* network byte order */
+    uint32_t    local_port;     /* host byte order */
+};
+
+#define SM_INSN(_code, _dst, _src, _off, _imm)                          \
+    ((struct bpf_insn) {                                                \
+        .code = (_code), .dst_reg = (_dst), .src_reg = (_src),          \
+        .off = (_off), .imm = (_imm) })
+
+#define SM_SKB_OFF(_field)  ((int16_t)offsetof(struct __sk_buff, _field))
+
+static int
+sockmap_bpf(int cmd, union bpf_attr *attr) {
+    return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int
+sockmap_create(void) {
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_SOCKHASH;
+    attr.key_size = sizeof(struct sockmap_key);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = SOCKMAP_MAX_ENTRIES;
+
+    return sockmap_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int
+sockmap_load(struct bpf_insn *insns, size_t n, const char *name) {
+    union bpf_attr attr;
+    char buf[SOCKMAP_LOG_SIZE];
+    int fd;
+
+    buf[0] = '\0';
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr.insns = (uint64_t)(uintptr_t)insns;
+    attr.insn_cnt = (uint32_t)n;
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+    attr.log_buf = (uint64_t)(uintptr_t)buf;
+    attr.log_size = sizeof(buf);
+    attr.log_level = 1;
+
+    fd = sockmap_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0) {
+        log_debug("load sockmap %s program failed: %s, %s", name, strerror(errno), buf);
+    }
+
+    return fd;
+}
+
+/* Whole skb is one message, no framing */
+static int
+sockmap_load_parser(void) {
+    struct bpf_insn insns[] = {
+        /* r0 = skb->len */
+        SM_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_1, SM_SKB_OFF(len), 0),
+        SM_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+
+    return sockmap_load(insns, sizeof(insns) / sizeof(insns[0]), "parser");
+}
+
+static int
+sockmap_load_verdict(int targets) {
+    struct bpf_insn insns[] = {
+        /* build struct sockmap_key at r10 - 16 */
+        SM_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, SM_SKB_OFF(remote_ip4), 0),
+        SM_INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -16, 0),
+        SM_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, SM_SKB_OFF(local_ip4), 0),
+        SM_INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -12, 0),
+        SM_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, SM_SKB_OFF(remote_port), 0),
+        /* some kernels hand out remote_port shifted into the upper half */
+        SM_INSN(BPF_JMP | BPF_JSET | BPF_K, BPF_REG_2, 0, 1, (int32_t)0xffff0000),
+        SM_INSN(BPF_JMP | BPF_JA, 0, 0, 1, 0),
+        SM_INSN(BPF_ALU | BPF_RSH | BPF_K, BPF_REG_2, 0, 0, 16),
+        SM_INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -8, 0),
+        SM_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, SM_SKB_OFF(local_port), 0),
+        SM_INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -4, 0),
+        /* bpf_sk_redirect_hash(skb, targets, &key, 0) */
+        SM_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, targets),
+        SM_INSN(0, 0, 0, 0, 0),
+        SM_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        SM_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16),
+        SM_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+        SM_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+        /* pass without redirect lets bytes fall back to the receiving socket */
+        SM_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+        SM_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+
+    return sockmap_load(insns, sizeof(insns) / sizeof(insns[0]), "verdict");
+}
+
+static int
+sockmap_attach(int map, int prog, enum bpf_attach_type type) {
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.target_fd = (uint32_t)map;
+    attr.attach_bpf_fd = (uint32_t)prog;
+    attr.attach_type = type;
+
+    return sockmap_bpf(BPF_PROG_ATTACH, &attr);
+}
+
+static int
+sockmap_update(int map, struct sockmap_key *key, int fd) {
+    union bpf_attr attr;
+    uint32_t value;
+
+    value = (uint32_t)fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t)map;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)&value;
+    attr.flags = BPF_ANY;
+
+    return sockmap_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static void
+sockmap_delete(int map, struct sockmap_key *key) {
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t)map;
+    attr.key = (uint64_t)(uintptr_t)key;
+
+    sockmap_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+static int
+sockmap_key(int fd, struct sockmap_key *key) {
+    struct sockaddr_in local, remote;
+    socklen_t len;
+
+    len = sizeof(local);
+    if (getsockname(fd, (struct sockaddr *)&local, &len) < 0 || local.sin_family != AF_INET) {
+        return -1;
+    }
+
+    len = sizeof(remote);
+    if (getpeername(fd, (struct sockaddr *)&remote, &len) < 0 || remote.sin_family != AF_INET) {
+        return -1;
+    }
+
+    key->remote_ip4 = remote.sin_addr.s_addr;
+    key->local_ip4 = local.sin_addr.s_addr;
+    key->remote_port = (uint32_t)remote.sin_port;
+    key->local_port = (uint32_t)ntohs(local.sin_port);
+
+    return 0;
+}
+
+void
+sockmap_null(struct sockmap *sm) {
+    sm->targets = -1;
+    sm->sources = -1;
+    sm->parser = -1;
+    sm->verdict = -1;
+}
+
+int
+sockmap_init(struct sockmap *sm) {
+    sockmap_null(sm);
+
+    sm->targets = sockmap_create();
+    if (sm->targets < 0) {
+        log_warn("create sockmap failed: %s", strerror(errno));
+        goto error;
+    }
+
+    sm->sources = sockmap_create();
+    if (sm->sources < 0) {
+        log_warn("create sockmap failed: %s", strerror(errno));
+        goto error;
+    }
+
+    sm->parser = sockmap_load_parser();
+    sm->verdict = sockmap_load_verdict(sm->targets);
+    if (sm->parser < 0 || sm->verdict < 0) {
+        log_warn("load sockmap programs failed: %s", strerror(errno));
+        goto error;
+    }
+
+    if (sockmap_attach(sm->sources, sm->parser, BPF_SK_SKB_STREAM_PARSER) < 0 ||
+            sockmap_attach(sm->sources, sm->verdict, BPF_SK_SKB_STREAM_VERDICT) < 0) {
+        log_warn("attach sockmap programs failed: %s", strerror(errno));
+        goto error;
+    }
+
+    return 0;
+
+error:
+    sockmap_deinit(sm);
+    return -1;
+}
+
+void
+sockmap_deinit(struct sockmap *sm) {
+    if (sm->verdict >= 0) {
+        close(sm->verdict);
+    }
+    if (sm->parser >= 0) {
+        close(sm->parser);
+    }
+    if (sm->sources >= 0) {
+        close(sm->sources);
+    }
+    if (sm->targets >= 0) {
+        close(sm->targets);
+    }
+    sockmap_null(sm);
+}
+
+/*
+ * Targets go in first, so that a socket never runs the verdict before its peer
+ * can be found. Return -1 with nothing inserted on failure.
+ */
+int
+sockmap_add(struct sockmap *sm, int fd1, int fd2) {
+    struct sockmap_key k1, k2;
+
+    if (sockmap_key(fd1, &k1) < 0 || sockmap_key(fd2, &k2) < 0) {
+        return -1;
+    }
+
+    if (sockmap_update(sm->targets, &k1, fd2) < 0) {
+        goto error;
+    }
+
+    if (sockmap_update(sm->targets, &k2, fd1) < 0) {
+        sockmap_delete(sm->targets, &k1);
+        goto error;
+    }
+
+    if (sockmap_update(sm->sources, &k1, fd1) < 0) {
+        goto error_targets;
+    }
+
+    if (sockmap_update(sm->sources, &k2, fd2) < 0) {
+        sockmap_delete(sm->sources, &k1);
+        goto error_targets;
+    }
+
+    return 0;
+
+error_targets:
+    sockmap_delete(sm->targets, &k1);
+    sockmap_delete(sm->targets, &k2);
+error:
+    log_debug("insert sockets into sockmap failed: %s", strerror(errno));
+    return -1;
+}
+
+/* Sources go out first, stop the verdict before the targets disappear */
+void
+sockmap_del(struct sockmap *sm, int fd1, int fd2) {
+    struct sockmap_key k1, k2;
+    int r1, r2;
+
+    r1 = sockmap_key(fd1, &k1);
+    r2 = sockmap_key(fd2, &k2);
+
+    if (r1 == 0) {
+        sockmap_delete(sm->sources, &k1);
+    }
+    if (r2 == 0) {
+        sockmap_delete(sm->sources, &k2);
+    }
+    if (r1 == 0) {
+        sockmap_delete(sm->targets, &k1);
+    }
+    if (r2 == 0) {
+        sockmap_delete(sm->targets, &k2);
+    }
+}
+
+/* Bytes received from and acked by the remote, used to tell redirected traffic */
+int
+sockmap_tcp_bytes(int fd, uint64_t *received, uint64_t *acked) {
+    struct tcp_info info;
+    socklen_t len;
+
+    memset(&info, 0, sizeof(info));
+    len = sizeof(info);
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return -1;
+    }
+
+    if (len < offsetof(struct tcp_info, tcpi_bytes_received) + sizeof(info.tcpi_bytes_received)) {
+        return -1;
+    }
+
+    *received = info.tcpi_bytes_received;
+    *acked = info.tcpi_bytes_acked;
+
+    return 0;
+}
+
+#else
+
+void
+sockmap_null(struct sockmap *sm) {
+    sm->targets = -1;
+    sm->sources = -1;
+    sm->parser = -1;
+    sm->verdict = -1;
+}
+
+int
+sockmap_init(struct sockmap *sm) {
+    sockmap_null(sm);
+    return -1;
+}
+
+void
+sockmap_deinit(struct sockmap *sm) {
+    sockmap_null(sm);
+}
+
+int
+sockmap_add(struct sockmap *sm, int fd1, int fd2) {
+    (void)sm; (void)fd1; (void)fd2;
+    return -1;
+}
+
+void
+sockmap_del(struct sockmap *sm, int fd1, int fd2) {
+    (void)sm; (void)fd1; (void)fd2;
+}
+
+int
+sockmap_tcp_bytes(int fd, uint64_t *received, uint64_t *acked) {
+    (void)fd; (void)received; (void)acked;
+    return -1;
+}
+
+#endif
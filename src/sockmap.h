@@ -0,0 +1,34 @@
+/*
+ * BPF sockmap redirect of established tunnels (linux only).
+ *
+ * Sockets of a tunnel are inserted into two sockhash maps keyed by their own 4-tuple:
+ * targets map holds the peer socket of each key, sources map carries the stream parser
+ * and verdict programs. The verdict program looks up the 4-tuple of the receiving socket
+ * in targets map and redirects the bytes to the peer socket entirely in kernel,
+ * bytes fall back to the socket itself when no peer found.
+ *
+ * Only IPv4 tunnels are supported.
+ */
+
+#ifndef _RPS_SOCKMAP_H
+#define _RPS_SOCKMAP_H
+
+#include <stdint.h>
+
+#define SOCKMAP_MAX_ENTRIES     65536
+
+struct sockmap {
+    int         targets;
+    int         sources;
+    int         parser;
+    int         verdict;
+};
+
+void sockmap_null(struct sockmap *sm);
+int sockmap_init(struct sockmap *sm);
+void sockmap_deinit(struct sockmap *sm);
+int sockmap_add(struct sockmap *sm, int fd1, int fd2);
+void sockmap_del(struct sockmap *sm, int fd1, int fd2);
+int sockmap_tcp_bytes(int fd, uint64_t *received, uint64_t *acked);
+
+#endif
@@ -3,17 +3,24 @@
 #include "util.h"
 #include "config.h"
 #include "_string.h"
+#include "heap.h"
+#include "api.h"
+#include "murmur3/murmur3.h"
 
 #include <uv.h>
 #include <jansson.h>
-#include <curl/curl.h>
+#include <unistd.h>
+#include <ctype.h>
 
-typedef struct upstream * (*upstream_pool_get_algorithm)(struct upstream_pool *);
+typedef struct upstream * (*upstream_pool_get_algorithm)(struct upstreams *,
+        struct upstream_pool *, struct upstream_snapshot *, uint32_t *hash);
 
-struct curl_buf {
-    uint8_t *buf;
-    size_t  len;
-};
+/* reader slot of the calling thread */
+static __thread struct upstream_reader *upstream_reader;
+
+/* counter shard of the calling thread, -1 until its first count */
+static __thread int upstream_shard = -1;
+static uint32_t upstream_nshards;
 
 void
 upstream_init(struct upstream *u) {
@@ -21,15 +28,36 @@ upstream_init(struct upstream *u) {
     string_init(&u->passwd);   
     string_init(&u->source);
     u->weight = UPSTREAM_DEFAULT_WEIGHT;
+    u->max_inflight = 0;
+    u->vt = -1;
     u->proto = UNSUPPORT;
     u->success = 0;
     u->failure = 0;
     u->count = 0;
     u->insert_date = 0;
     u->expire_date = 0;
+    u->connect_time = 0;
+    u->handshake_time = 0;
     u->enable = 0;
-
-    queue_null(&u->timewheel);
+    u->lock = 0;
+    u->ready = UPSTREAM_NOT_READY;
+    u->wake = 0;
+    u->parked = 0;
+    u->retired = 0;
+    u->probes = 0;
+    u->pool = NULL;
+    u->dirty_next = NULL;
+    u->dirty = 0;
+    u->seen = 0;
+    u->marks = 0;
+    u->breaker = up_closed;
+    u->trips = 0;
+    u->since = 0;
+    memset(&u->base, 0, sizeof(u->base));
+    memset(&u->prev, 0, sizeof(u->prev));
+    memset(u->shards, 0, sizeof(u->shards));
+
+    rate_init(&u->rate);
 }
 
 void
@@ -42,28 +70,158 @@ upstream_deinit(struct upstream *u) {
     u->count = 0;
     u->insert_date = 0;
     u->expire_date = 0;
+}
 
-    if (!queue_is_null(&u->timewheel)) {
-        queue_deinit(&u->timewheel);
+static struct upstream_shard *
+upstream_shard_get(struct upstream *u) {
+    if (upstream_shard < 0) {
+        upstream_shard = __atomic_fetch_add(&upstream_nshards, 1, __ATOMIC_RELAXED) % UPSTREAM_SHARDS;
     }
+
+    return &u->shards[upstream_shard];
 }
 
-static rps_status_t
-upstream_init_timewheel(struct upstream *u, uint32_t mr1m, uint32_t mr1h, uint32_t mr1d) {
-    uint32_t n;
+/* Sum up base values and shards, lock free */
+void
+upstream_counters(struct upstream *u, struct upstream_counter *c) {
+    struct upstream_shard *shard;
+    uint32_t i;
 
-    n = MAX(MAX(mr1m, mr1h), mr1d);
-    
-    n = n > 0 ? n : UPSTREAM_DEFAULT_TIME_WHEEL_LENGTH;
+    c->success = __atomic_load_n(&u->success, __ATOMIC_RELAXED);
+    c->failure = __atomic_load_n(&u->failure, __ATOMIC_RELAXED);
+    c->count = __atomic_load_n(&u->count, __ATOMIC_RELAXED);
+
+    for (i = 0; i < UPSTREAM_SHARDS; i++) {
+        shard = &u->shards[i];
+        c->success += __atomic_load_n(&shard->success, __ATOMIC_RELAXED);
+        c->failure += __atomic_load_n(&shard->failure, __ATOMIC_RELAXED);
+        c->count += __atomic_load_n(&shard->count, __ATOMIC_RELAXED);
+    }
+}
+
+/* 
+ * Queue u on its pool's dirty list for the next stats commit, once per round. Lock free,
+ * the stats pass takes the whole list and marks each upstream clean before reading it.
+ * The caller's counter update is a full barrier, a change racing with the pass either
+ * makes it or queues u again.
+ */
+static void
+upstream_dirty(struct upstream *u) {
+    struct upstream_pool *up;
+    struct upstream *head;
+    uint32_t clean;
+
+    up = u->pool;
+    if (up == NULL || !up->tracked) {
+        return;
+    }
+
+    if (__atomic_load_n(&u->dirty, __ATOMIC_SEQ_CST) != 0) {
+        return;
+    }
+
+    clean = 0;
+    if (!__atomic_compare_exchange_n(&u->dirty, &clean, __atomic_load_n(&up->gen, __ATOMIC_RELAXED),
+                false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    head = __atomic_load_n(&up->dirty, __ATOMIC_RELAXED);
+    do {
+        u->dirty_next = head;
+    } while (!__atomic_compare_exchange_n(&up->dirty, &head, u, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * The outcome balances the session's count, reclaim may free u once it sees that.
+ * marks covers what follows it, reclaim waits for marks to drop back to 0.
+ */
+void
+upstream_mark_success(struct upstream *u) {
+    __atomic_add_fetch(&u->marks, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&upstream_shard_get(u)->success, 1, __ATOMIC_SEQ_CST);
+    upstream_dirty(u);
+    __atomic_sub_fetch(&u->marks, 1, __ATOMIC_RELEASE);
+}
+
+static void
+upstream_ewma(uint32_t *avg, uint64_t sample) {
+    uint32_t old, new;
 
-    return queue_init(&u->timewheel, n);
+    sample = MIN(sample, UINT32_MAX);
+    old = __atomic_load_n(avg, __ATOMIC_RELAXED);
+
+    do {
+        if (old == 0) {
+            new = (uint32_t)sample;
+        } else {
+            new = (uint32_t)((int64_t)old + (((int64_t)sample - old) >> UPSTREAM_EWMA_SHIFT));
+        }
+    } while (!__atomic_compare_exchange_n(avg, &old, new, true,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* A failed attempt counts as a slow one, or fast failing upstreams would attract sessions */
+void
+upstream_mark_failure(struct upstream *u) {
+    upstream_ewma(&u->handshake_time, UPSTREAM_FAIL_PENALTY);
+    __atomic_add_fetch(&u->marks, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&upstream_shard_get(u)->failure, 1, __ATOMIC_SEQ_CST);
+    upstream_dirty(u);
+    __atomic_sub_fetch(&u->marks, 1, __ATOMIC_RELEASE);
+}
+
+void
+upstream_mark_connect(struct upstream *u, uint64_t usec) {
+    upstream_ewma(&u->connect_time, usec);
+}
+
+void
+upstream_mark_established(struct upstream *u, uint64_t usec) {
+    upstream_ewma(&u->handshake_time, usec);
+}
+
+/* Sessions picked it and not finished yet */
+static uint32_t
+upstream_inflight(struct upstream *u) {
+    struct upstream_counter c;
+
+    upstream_counters(u, &c);
+
+    return c.count - c.success - c.failure;
 }
 
+static bool
+upstream_saturated(struct upstream *u, uint32_t max_inflight) {
+    uint32_t limit;
+
+    limit = u->max_inflight > 0 ? u->max_inflight : max_inflight;
+
+    return limit > 0 && upstream_inflight(u) >= limit;
+}
+
+static void
+upstream_spin_lock(uint32_t *lock) {
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+            /* spin */
+        }
+    }
+}
+
+static void
+upstream_spin_unlock(uint32_t *lock) {
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
 
 static void
 upstream_copy(struct upstream *dst, struct upstream *src) {
+    struct upstream_counter c;
+
     dst->proto = src->proto;
     dst->weight = src->weight;
+    dst->max_inflight = src->max_inflight;
 
     memcpy(&dst->server, &src->server, sizeof(src->server));
     if (!string_empty(&src->uname)) {
@@ -76,12 +234,14 @@ upstream_copy(struct upstream *dst, struct upstream *src) {
         string_copy(&dst->source, &src->source);
     }
     
-    dst->success = src->success;
-    dst->failure = src->failure;
-    dst->count = src->count;
+    upstream_counters(src, &c);
+    dst->success = c.success;
+    dst->failure = c.failure;
+    dst->count = c.count;
     dst->insert_date = src->insert_date;
     dst->expire_date = src->expire_date;
     dst->enable = src->enable;
+    memcpy(&dst->rate, &src->rate, sizeof(src->rate));
 }
 
 static int 
@@ -99,26 +259,23 @@ static void
 upstream_str(void *data) {
     char name[MAX_HOSTNAME_LEN];
     struct upstream *u;
+    struct upstream_counter c;
 
     u = (struct upstream *)data;
+    upstream_counters(u, &c);
 
     rps_unresolve_addr(&u->server, name);
     log_verb("\t%s://%s:%s@%s:%d (s:%d, f:%d, c:%d, d:%d) expire_date:%d", rps_proto_str(u->proto), 
             u->uname.data, u->passwd.data, name, rps_unresolve_port(&u->server), 
-            u->success, u->failure, u->count, queue_n(&u->timewheel), u->expire_date);
+            c.success, c.failure, c.count, rate_day_n(&u->rate), u->expire_date);
 }
 #endif
 
 static bool
-upstream_freshly(struct upstream *u) {
-    return queue_is_null(&u->timewheel);
-}
-
-static bool
-upstream_poor_quality(struct upstream *u, float max_fail_rate) {
+upstream_poor_quality(uint32_t success, uint32_t failure, float max_fail_rate) {
     float fail_rate;
 
-    if (u->failure <= UPSTREAM_MIN_FAILURE) {
+    if (failure <= UPSTREAM_MIN_FAILURE) {
         return false;
     }
 
@@ -127,85 +284,237 @@ upstream_poor_quality(struct upstream *u, float max_fail_rate) {
         return false;
     }
 
-    fail_rate = (u->failure/(float)(u->failure + u->success));
+    fail_rate = (failure/(float)(failure + success));
 
     return fail_rate > max_fail_rate;
 }
 
+/* Open time in wake, 0 parks it for health probes */
+static void
+upstream_breaker_open(struct upstream *u, bool probed, uint64_t now, uint64_t *wake) {
+    u->breaker = up_open;
+    if (probed) {
+        *wake = 0;
+    } else {
+        *wake = now + ((uint64_t)UPSTREAM_BREAKER_OPEN << MIN(u->trips, UPSTREAM_BREAKER_MAX_TRIPS));
+    }
+    if (u->trips < UINT8_MAX) {
+        u->trips++;
+    }
+}
 
-static bool
-upstream_request_too_often(struct upstream *u, uint32_t mr1m, uint32_t mr1h, uint32_t mr1d) {
-    uint32_t m, h, d;   
-    uint32_t i, j, n;
-    rps_ts_t now, m_ago, h_ago, d_ago;
-    rps_ts_t ts;
-    rps_ts_t deadline;
-    rps_queue_t *timewheel;
+static void
+upstream_breaker_close(struct upstream *u, struct upstream_counter *c, uint64_t now) {
+    u->breaker = up_closed;
+    u->trips = 0;
+    u->prev = *c;
+    u->base = *c;
+    u->since = now;
+}
 
-    m = 0;
-    h = 0;
-    d = 0;
+/*
+ * Whether the breaker lets a session through, under the upstream's lock. A refused 
+ * one gets the time to ask again in wake, an open one turns half-open by then.
+ * Health checked ones stay open, probes close them.
+ */
+static bool
+upstream_breaker_allow(struct upstream *u, struct upstreams *us, uint64_t now, 
+        uint64_t *wake) {
+    struct upstream_counter c;
+    bool allow;
 
-    now = rps_now();
-    m_ago = now - 60;
-    h_ago = now - 60 * 60;
-    d_ago = now - 60 * 60 * 24;
+    upstream_counters(u, &c);
 
-    timewheel = &u->timewheel;
+    upstream_spin_lock(&u->lock);
 
-    i = timewheel->head;
-    n = queue_n(timewheel);
-    
-    if (mr1d > 0) {
-        deadline = d_ago;
-    } else if (mr1h > 0) {
-        deadline = h_ago;
-    } else if (mr1m > 0) {
-        deadline = m_ago;
-    } else {
-        deadline = now;
-    }
-    
-    for (j = 0; j < n; j++) {
-        ts = (rps_ts_t)timewheel->elts[i];
-        i = (i + 1) % timewheel->nelts;
+    allow = true;
 
-        //remove the ts older than deadline.
-        if (ts < deadline) {
-            queue_de(timewheel);
-            continue;   
+    switch (u->breaker) {
+    case up_closed:
+        if (u->since == 0 || now - u->since >= UPSTREAM_BREAKER_WINDOW) {
+            u->prev = u->since == 0 ? c : u->base;
+            u->base = c;
+            u->since = now;
         }
 
-        if (ts > m_ago) {
-            m += 1;
-            h += 1;
-            continue;
+        if (upstream_poor_quality(c.success - u->prev.success, 
+                    c.failure - u->prev.failure, us->max_fail_rate)) {
+            upstream_breaker_open(u, us->probed, now, wake);
+            allow = false;
         }
+        break;
 
-        if (ts > h_ago) {
-            h += 1;
+    case up_open:
+        if (us->probed) {
+            *wake = 0;
+            allow = false;
+            break;
         }
+        u->breaker = up_half_open;
+        u->base = c;
+        u->since = now;
+        /* fall through */
+
+    case up_half_open:
+        if (c.failure != u->base.failure) {
+            upstream_breaker_open(u, us->probed, now, wake);
+            allow = false;
+        } else if (c.success - u->base.success >= UPSTREAM_BREAKER_TRIALS) {
+            upstream_breaker_close(u, &c, now);
+        } else if (c.count - u->base.count >= UPSTREAM_BREAKER_TRIALS) {
+            *wake = now + UPSTREAM_BREAKER_PROBE;
+            allow = false;
+        }
+        break;
+
+    default:
+        NOT_REACHED();
     }
 
-    d = queue_n(timewheel); 
+    upstream_spin_unlock(&u->lock);
+
+    return allow;
+}
+
+
+/* 
+ * Check the rate windows and count the request in them, under the upstream's lock.
+ * A refused one gets the time it may pass again in wake.
+ */
+static bool
+upstream_admit(struct upstream *u, struct upstreams *us, uint64_t now, uint64_t *wake) {
+    bool admit;
 
-    //no free timewhell slot means balance exhasuted 
-    if queue_is_full(timewheel) {
+    if (!rate_limited(&us->limit)) {
         return true;
     }
 
-    return ((mr1m != 0 && m >= mr1m) || 
-            (mr1h != 0 && h >= mr1h) || 
-            (mr1d != 0 && d >= mr1d));
+    upstream_spin_lock(&u->lock);
+
+    admit = rate_allow(&u->rate, &us->limit, now);
+    if (admit) {
+        rate_add(&u->rate, &us->limit, now);
+    } else {
+        *wake = rate_next(&u->rate, &us->limit, now);
+    }
+
+    upstream_spin_unlock(&u->lock);
+
+    return admit;
+}
+
+static int
+upstream_wake_cmp(const void *a, const void *b) {
+    uint64_t wa, wb;
+
+    wa = ((const struct upstream *)a)->wake;
+    wb = ((const struct upstream *)b)->wake;
+
+    return wa < wb ? -1 : (wa > wb ? 1 : 0);
 }
 
+#define upstream_is_ready(_u)                                       \
+    (__atomic_load_n(&(_u)->ready, __ATOMIC_RELAXED) != UPSTREAM_NOT_READY)
+
+#define upstream_ready_n(_ss)                                       \
+    __atomic_load_n(&(_ss)->nready, __ATOMIC_ACQUIRE)
+
+/* A slot may hold one that just left, picks check upstream_is_ready */
+#define upstream_ready_get(_ss, _i)                                 \
+    __atomic_load_n(&(_ss)->ready[(_i)], __ATOMIC_RELAXED)
+
+/* Ready set updates below run under the pool's lock, on its current snapshot */
 static void
-upstream_timewheel_add(struct upstream *u) {
-    rps_ts_t now;
-    
-    now = rps_now();
+upstream_ready_add(struct upstream_snapshot *ss, struct upstream *u) {
+    if (u->ready != UPSTREAM_NOT_READY) {
+        return;
+    }
+
+    __atomic_store_n(&ss->ready[ss->nready], u, __ATOMIC_RELAXED);
+    __atomic_store_n(&u->ready, ss->nready, __ATOMIC_RELAXED);
+    __atomic_store_n(&ss->nready, ss->nready + 1, __ATOMIC_RELEASE);
+}
+
+static bool
+upstream_ready_remove(struct upstream_snapshot *ss, struct upstream *u) {
+    struct upstream *last;
+    uint32_t i;
+
+    i = u->ready;
+
+    /* out of it, or a retired one left over by an older snapshot */
+    if (i >= ss->nready || ss->ready[i] != u) {
+        return false;
+    }
+
+    last = ss->ready[ss->nready - 1];
+    __atomic_store_n(&ss->ready[i], last, __ATOMIC_RELAXED);
+    __atomic_store_n(&last->ready, i, __ATOMIC_RELAXED);
+    __atomic_store_n(&u->ready, UPSTREAM_NOT_READY, __ATOMIC_RELAXED);
+    __atomic_store_n(&ss->nready, ss->nready - 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static void
+upstream_pool_sleeping_update(struct upstream_pool *up) {
+    struct upstream *u;
+
+    u = heap_top(&up->sleeping);
+    __atomic_store_n(&up->wake, u != NULL ? u->wake : 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Leave the ready set until wake, ms. 0 parks it until a health probe passes.
+ * Returns false if it stays in the set.
+ */
+static bool
+upstream_pool_throttle(struct upstream_pool *up, struct upstream *u, uint64_t wake) {
+    bool left;
 
-    queue_en(&u->timewheel, (void *)now);
+    left = true;
+
+    upstream_spin_lock(&up->lock);
+
+    if (upstream_ready_remove(up->snapshot, u)) {
+        if (wake == 0) {
+            u->parked = 1;
+            upstream_spin_unlock(&up->lock);
+            return true;
+        }
+
+        u->wake = wake;
+        if (heap_push(&up->sleeping, u) != RPS_OK) {
+            /* stay schedulable, admission keeps refusing it */
+            u->wake = 0;
+            upstream_ready_add(up->snapshot, u);
+            left = false;
+        }
+        upstream_pool_sleeping_update(up);
+    }
+
+    upstream_spin_unlock(&up->lock);
+
+    return left;
+}
+
+/* Throttled upstreams whose time came are ready again */
+static void
+upstream_pool_wake(struct upstream_pool *up, uint64_t now) {
+    struct upstream *u;
+
+    upstream_spin_lock(&up->lock);
+
+    while ((u = heap_top(&up->sleeping)) != NULL && u->wake <= now) {
+        heap_pop(&up->sleeping);
+        u->wake = 0;
+        if (u->enable) {
+            upstream_ready_add(up->snapshot, u);
+        }
+    }
+    upstream_pool_sleeping_update(up);
+
+    upstream_spin_unlock(&up->lock);
 }
 
 static rps_status_t
@@ -215,7 +524,17 @@ upstream_pool_init(struct upstream_pool *up, struct config_upstream *cu,
     char stats_api[MAX_API_LENGTH];
 
     up->timeout = capi->timeout;
-    uv_rwlock_init(&up->rwlock);
+    up->loading = 0;
+    up->posting = 0;
+    up->once = 0;
+    up->dirty = NULL;
+    up->gen = 1;
+    up->tracked = 0;
+    up->payload = NULL;
+    up->payload_size = 0;
+    up->sweep = 0;
+    up->unpublished = 0;
+    string_init(&up->revision);
 
     up->proto = rps_proto_int((const char *)cu->proto.data);
     if (up->proto < 0) {
@@ -233,7 +552,7 @@ upstream_pool_init(struct upstream_pool *up, struct config_upstream *cu,
             snprintf(api, MAX_API_LENGTH, "%s/proxy/socks5/?source=%s", 
                     capi->url.data, capi->s5_source.data);
         }
-        snprintf(stats_api, MAX_API_LENGTH, "%s/stats/socks5/", capi->url.data);
+        snprintf(stats_api, MAX_API_LENGTH, "%s/stats/socks5/bulk", capi->url.data);
         break;
     case HTTP:
         if (string_empty(&capi->http_source)) {
@@ -242,7 +561,7 @@ upstream_pool_init(struct upstream_pool *up, struct config_upstream *cu,
             snprintf(api, MAX_API_LENGTH, "%s/proxy/http/?source=%s", 
                     capi->url.data, capi->http_source.data);
         }
-        snprintf(stats_api, MAX_API_LENGTH, "%s/stats/http/", capi->url.data);
+        snprintf(stats_api, MAX_API_LENGTH, "%s/stats/http/bulk", capi->url.data);
         break;
     case HTTP_TUNNEL:
         if (string_empty(&capi->http_tunnel_source)) {
@@ -251,7 +570,7 @@ upstream_pool_init(struct upstream_pool *up, struct config_upstream *cu,
             snprintf(api, MAX_API_LENGTH, "%s/proxy/http_tunnel/?source=%s", 
                     capi->url.data, capi->http_tunnel_source.data);
         }
-        snprintf(stats_api, MAX_API_LENGTH, "%s/stats/http_tunnel/", capi->url.data);
+        snprintf(stats_api, MAX_API_LENGTH, "%s/stats/http_tunnel/bulk", capi->url.data);
         break;
     default:
         NOT_REACHED();
@@ -265,10 +584,25 @@ upstream_pool_init(struct upstream_pool *up, struct config_upstream *cu,
     }
 
     if (hashmap_init(&up->pool, UPSTREAM_DEFAULT_POOL_LENGTH, HASHMAP_DEFAULT_COLLISIONS) != RPS_OK) {
-        return RPS_ERROR;       
+        return RPS_ERROR;
+    }
+
+    up->snapshot = NULL;
+    up->cursor = 0;
+    up->lock = 0;
+    up->wake = 0;
+
+    if (array_init(&up->retired, 16, sizeof(struct upstream *)) != RPS_OK) {
+        return RPS_ERROR;
+    }
+
+    if (heap_init(&up->sleeping, 16, upstream_wake_cmp) != RPS_OK) {
+        return RPS_ERROR;
     }
 
-    hashmap_iterator_init(&up->iter, &up->pool);
+    if (array_init(&up->stats, 64, sizeof(struct upstream_stat)) != RPS_OK) {
+        return RPS_ERROR;
+    }
 
     return RPS_OK;
 }
@@ -286,15 +620,49 @@ upstream_pool_deinit_foreach(void *data) {
     
 }
 
+static void
+upstream_snapshot_destroy(struct upstream_snapshot *ss) {
+    if (ss->round != NULL) {
+        rps_free(ss->round);
+    }
+    if (ss->ring != NULL) {
+        rps_free(ss->ring);
+    }
+    if (ss->ready != NULL) {
+        rps_free(ss->ready);
+    }
+    rps_free(ss);
+}
+
 static void
 upstream_pool_deinit(struct upstream_pool *up) {
+    struct upstream *u;
+
     hashmap_foreach2(&up->pool, (hashmap_foreach2_t)upstream_pool_deinit_foreach);
     hashmap_deinit(&up->pool);
-    hashmap_iterator_deinit(&up->iter);
+
+    if (up->snapshot != NULL) {
+        upstream_snapshot_destroy(up->snapshot);
+        up->snapshot = NULL;
+    }
+
+    while (array_n(&up->retired)) {
+        u = *(struct upstream **)array_pop(&up->retired);
+        upstream_deinit(u);
+        rps_free(u);
+    }
+    array_deinit(&up->retired);
+    heap_deinit(&up->sleeping);
+    array_deinit(&up->stats);
+    if (up->payload != NULL) {
+        rps_free(up->payload);
+        up->payload = NULL;
+    }
+
     string_deinit(&up->api);
     string_deinit(&up->stats_api);
+    string_deinit(&up->revision);
     up->timeout = 0;
-    uv_rwlock_destroy(&up->rwlock);
 } 
 
 #ifdef  RPS_MORE_VERBOSE
@@ -318,10 +686,29 @@ upstreams_init(struct upstreams *us, struct config_api *capi,
     us->hybrid = cus->hybrid;   
     us->maxreconn = cus->maxreconn;
     us->maxretry = cus->maxretry;
-    us->mr1m = cus->mr1m;
-    us->mr1h = cus->mr1h;
-    us->mr1d = cus->mr1d;
+    us->limit.mr1m = cus->mr1m;
+    us->limit.mr1h = cus->mr1h;
+    us->limit.mr1d = cus->mr1d;
+    us->limit.rate = cus->rate;
+    us->limit.burst = cus->burst;
     us->max_fail_rate = cus->max_fail_rate;
+    us->max_inflight = cus->max_inflight;
+    us->probed = cus->health_check > 0;
+
+    us->epoch = 1;
+    us->nreaders = 0;
+    memset(us->readers, 0, sizeof(us->readers));
+
+    if (string_empty(&cus->chash_key) || rps_strcmp(&cus->chash_key, "client") == 0) {
+        us->hash_key = up_hash_client;
+    } else if (rps_strcmp(&cus->chash_key, "remote") == 0) {
+        us->hash_key = up_hash_remote;
+    } else if (rps_strcmp(&cus->chash_key, "session") == 0) {
+        us->hash_key = up_hash_session;
+    } else {
+        log_error("unsupport chash key:%s", cus->chash_key.data);
+        return RPS_ERROR;
+    }
 
     schedule = &cus->schedule;
     if (rps_strcmp(schedule, "rr") == 0) {
@@ -329,8 +716,13 @@ upstreams_init(struct upstreams *us, struct config_api *capi,
     } else if (rps_strcmp(schedule, "random") == 0) {
         us->schedule = up_random;
     } else if (rps_strcmp(schedule, "wrr") == 0) {
-        log_error("wrr algorithm have not implemented");
-        abort();
+        us->schedule = up_wrr;
+    } else if (rps_strcmp(schedule, "p2c") == 0) {
+        us->schedule = up_p2c;
+    } else if (rps_strcmp(schedule, "least_conn") == 0) {
+        us->schedule = up_least_conn;
+    } else if (rps_strcmp(schedule, "chash") == 0) {
+        us->schedule = up_chash;
     } else {
         NOT_REACHED();
     }
@@ -349,8 +741,11 @@ upstreams_init(struct upstreams *us, struct config_api *capi,
         if (upstream_pool_init(up, cu, capi) != RPS_OK) {
             goto error;
         }
+        up->upstreams = us;
     }
 
+    us->pending = len;
+
     if (uv_mutex_init(&us->mutex) < 0) {
         goto error;     
     }
@@ -433,6 +828,8 @@ upstream_json_parse(struct upstream *u, json_t *element) {
             }
         } else if (strcmp(json_object_iter_key(kv), "weight") == 0) {
             u->weight = (uint16_t)json_integer_value(tmp);
+        } else if (strcmp(json_object_iter_key(kv), "max_inflight") == 0) {
+            u->max_inflight = (uint32_t)json_integer_value(tmp);
         } else if (strcmp(json_object_iter_key(kv), "success") == 0) {
             u->success = (uint32_t)json_integer_value(tmp);
         } else if (strcmp(json_object_iter_key(kv), "failure") == 0) {
@@ -465,10 +862,8 @@ upstream_json_parse(struct upstream *u, json_t *element) {
 }
 
 static rps_status_t
-upstream_pool_json_parse(rps_hashmap_t *pool, struct curl_buf *resp) {
-    json_t *root;
+upstream_pool_json_parse(rps_hashmap_t *pool, json_t *root) {
     json_t *element;
-    json_error_t error;
     char u_key[UPSTREAM_KEY_MAX_LENGTH];
     size_t key_size;
     struct upstream *u;
@@ -478,18 +873,6 @@ upstream_pool_json_parse(rps_hashmap_t *pool, struct curl_buf *resp) {
     i = 0;
     len = 0;
 
-    root = json_loads((const char *)resp->buf, 0, &error);
-    if (!root) {
-        log_error("json decode upstream pool error: %s", error.text);
-        return RPS_ERROR;
-    }
-
-    if (json_typeof(root) != JSON_ARRAY) {
-        log_error("json invalid records,  response should be array");
-        json_decref(root);
-        return RPS_ERROR;
-    }
-
     len = json_array_size(root);
     for (i = 0; i < len; i++) {
         element = json_array_get(root, i);
@@ -506,278 +889,943 @@ upstream_pool_json_parse(rps_hashmap_t *pool, struct curl_buf *resp) {
         hashmap_set(pool, u_key, key_size, &u, sizeof(u));
     }
 
-    json_decref(root);
-
     return RPS_OK;
 }
 
-static size_t
-upstream_pool_load_callback(void *contents, size_t size, size_t nmemb, void *userp) {
-    size_t realsize;
-    struct curl_buf *resp;
-        
-    realsize = size * nmemb;
+/* Unlink u from the pool, it leaves the next snapshot and reclaim frees it */
+static rps_status_t
+upstream_pool_retire(struct upstream_pool *up, struct upstream *u, void *key, size_t key_size) {
+    struct upstream **retired;
 
-    resp = (struct curl_buf *)userp;
-    resp->buf = rps_realloc(resp->buf, resp->len + realsize + 1);
-    if (resp->buf == NULL) {
-        log_error("fetech upstreams error, not enough memory");
-        return 0;
+    retired = (struct upstream **)array_push(&up->retired);
+    if (retired == NULL) {
+        return RPS_ENOMEM;
     }
+    *retired = u;
+    u->retired = 1;
+    up->unpublished = 1;
 
-    memcpy(&resp->buf[resp->len], contents, realsize); 
-    resp->len += realsize;
-    resp->buf[resp->len] = '\0';
-    
-    return realsize;
-}
+    hashmap_remove(&up->pool, key, key_size);
 
-static rps_status_t
-upstream_pool_load(rps_hashmap_t *pool, rps_str_t *api, uint32_t timeout) {
-    CURL *curl_handle;
-    CURLcode res;
-    struct curl_buf resp;
-    rps_status_t status;
+    return RPS_OK;
+}
 
-    resp.buf = rps_alloc(1);
-    resp.len = 0;
-
-    curl_handle = curl_easy_init();
-    curl_easy_setopt(curl_handle, CURLOPT_URL, api->data);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, upstream_pool_load_callback);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&resp);
-    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, RPS_CURL_UA);
-    curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1L);
-    curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, timeout);
-    res = curl_easy_perform(curl_handle);
-
-    if(res != CURLE_OK) {
-        log_error("fetch upstreams from '%s' trigger error. %s", 
-                api->data,  curl_easy_strerror(res));
-        status = RPS_ERROR;
-    } else {
-        log_verb("fetch upstreams from '%s' success, %zu bytes", api->data, resp.len);
-        status = RPS_OK;
-    }
-    
-    if (status == RPS_OK) {
-        status = upstream_pool_json_parse(pool, &resp);
+static bool
+upstream_str_equal(rps_str_t *a, rps_str_t *b) {
+    if (a->len != b->len) {
+        return false;
     }
-    
-    curl_easy_cleanup(curl_handle);
-    rps_free(resp.buf);
 
-    return status;
+    return a->len == 0 || memcmp(a->data, b->data, a->len) == 0;
 }
-static rps_status_t
-upstream_pool_merge(rps_hashmap_t *o_pool, rps_hashmap_t *n_pool) {
-    struct upstream *u, *nu, *ou;
+
+/*
+ * Insert a copy of u or update the pooled one in place, returns the pooled one.
+ * Sessions read credentials without lock, changed ones are replaced by a new copy.
+ */
+static struct upstream *
+upstream_pool_apply(struct upstream_pool *up, struct upstream *u) {
     char u_key[UPSTREAM_KEY_MAX_LENGTH];
-    uint32_t i;
     size_t key_size;
     size_t val_size;
-    struct hashmap_entry *e;
+    struct upstream *nu, *ou;
     void *ov;
 
-    u = NULL;
-    ou = NULL;
-    nu = NULL;
-
-    if (hashmap_is_empty(n_pool)) {
-        return RPS_OK;
+    key_size = upstream_key(u, u_key, UPSTREAM_KEY_MAX_LENGTH);
+    ov = hashmap_get(&up->pool, u_key, key_size, &val_size);
+
+    if (ov != NULL) {
+        ou = (struct upstream *)*(void **)ov;
+        if (!upstream_str_equal(&ou->uname, &u->uname) || 
+                !upstream_str_equal(&ou->passwd, &u->passwd) ||
+                !upstream_str_equal(&ou->source, &u->source)) {
+            /* the old one stays valid until reclaimed, its sessions keep their credentials */
+            if (upstream_pool_retire(up, ou, u_key, key_size) != RPS_OK) {
+                return NULL;
+            }
+            ov = NULL;
+        }
     }
 
-    for (i = 0; i < n_pool->size; i++) {
-        e = n_pool->buckets[i];
-        while (e != NULL) {
-            u = (struct upstream *)*(void **)e->value;
-            key_size = upstream_key(u, u_key, UPSTREAM_KEY_MAX_LENGTH);
-            ov = hashmap_get(o_pool, u_key, key_size, &val_size);
-            if (ov == NULL) {
-                /* insert new upstream proxy */
-                if ((nu = rps_alloc(sizeof(struct upstream))) == NULL) {
-                    return RPS_ENOMEM;
-                }   
-                upstream_init(nu);
-                upstream_copy(nu, u);
-                hashmap_set(o_pool, u_key, key_size, &nu, sizeof(nu));
-            } else {
-                /* update existence proxy */
-                ou = (struct upstream *)*(void **)ov;
-                if (!u->enable && ou->enable) {
-                    ou->enable = 0;
-                } else if (u->enable && !ou->enable) {
-                    ou->enable = 1;
-                    ou->failure /= 2; // shrink the fail rate
-                }
-            }
+    if (ov == NULL) {
+        /* insert new upstream proxy */
+        if ((nu = rps_alloc(sizeof(struct upstream))) == NULL) {
+            return NULL;
+        }   
+        upstream_init(nu);
+        upstream_copy(nu, u);
+        nu->pool = up;
+        hashmap_set(&up->pool, u_key, key_size, &nu, sizeof(nu));
+        upstream_dirty(nu);
+        return nu;
+    }
 
-            e = e->next;
-        }
+    /* update existence proxy */
+    ou = (struct upstream *)*(void **)ov;
+    ou->weight = u->weight;
+    ou->max_inflight = u->max_inflight;
+    ou->expire_date = u->expire_date;
+    /* the breaker judges quality, the api only switches it */
+    if (ou->enable != u->enable) {
+        ou->enable = u->enable;
+        upstream_dirty(ou);
     }
 
-    return RPS_OK;
+    return ou;
 }
 
-/* cleanup expired upstream proxy, recycle memory resource */
 static rps_status_t
-upstream_pool_cleanup(rps_hashmap_t *pool) {
-    uint32_t i;
-    rps_ts_t now;
+upstream_pool_merge(struct upstream_pool *up, rps_hashmap_t *n_pool) {
     struct hashmap_entry *e;
-    struct upstream *u;
-    char name[MAX_HOSTNAME_LEN];
-
-    now = rps_now();
-
-    for (i = 0; i < pool->size; i++) {
-        e = pool->buckets[i];
-        while (e != NULL) {
-            u = (struct upstream *)*(void **)e->value;
-            rps_unresolve_addr(&u->server, name);
-            /* unset expire date parameter */
-            if (u->expire_date == 0) {
-                e = e->next;
-                continue;
-            }
-
-            if (u->expire_date > now) {
-                e = e->next;
-                continue;
-            }
+    uint32_t i;
 
-#ifdef RPS_UPSTREAM_DELAY_CLEANUP
-            if (u->enable) {
-                e = e->next;
-                continue
-            }
-#endif
-            /* still be using */
-            if ((u->success + u->failure) != u->count) {
-                e = e->next;
-                continue;
+    for (i = 0; i < n_pool->size; i++) {
+        for (e = n_pool->buckets[i]; e != NULL; e = e->next) {
+            if (upstream_pool_apply(up, (struct upstream *)*(void **)e->value) == NULL) {
+                return RPS_ENOMEM;
             }
-            
-            log_verb("%s:%d be cleanup, expire_date:%ld, now:%ld (s:%d, f:%d, c:%d)", 
-                    name, rps_unresolve_port(&u->server), u->expire_date, now, 
-                    u->success, u->failure, u->count);
-
-            upstream_deinit(u);
-            rps_free(u);
-            hashmap_remove(pool, e->key, e->key_size);
-            e = e->next;
         }
     }
 
     return RPS_OK;
 }
 
-static rps_status_t
-upstream_stats_commit(struct upstream *u, rps_str_t *api, uint32_t timeout) {
-    CURL *curl_handle;
-    CURLcode res;
-    char name[MAX_HOSTNAME_LEN];
-    char payload[UPSTREAM_PAYLOAD_MAX_LENGTH];
-    rps_status_t status;
+/* Revision goes back in the query string, take opaque url safe tokens only */
+static bool
+upstream_revision_valid(const char *rev, size_t len) {
+    size_t i;
 
-    rps_unresolve_addr(&u->server, name);   
-    //avoid flush the output to stdout
-    FILE *devnull = fopen("/dev/null", "w+");
-
-    snprintf(payload, UPSTREAM_PAYLOAD_MAX_LENGTH, 
-        "ip=%s&port=%d&uname=%s&passwd=%s&source=%s&success=%d&failure=%d&count=%d&insert_date=%ld \
-        &expire_date=%ld&enable=%d&timewheel=%d",
-        name, rps_unresolve_port(&u->server), u->uname.data, u->passwd.data, u->source.data, u->success,
-        u->failure, u->count,(long int)u->insert_date, (long int)u->expire_date, u->enable, queue_n(&u->timewheel));
-
-    curl_handle = curl_easy_init();
-    curl_easy_setopt(curl_handle, CURLOPT_URL, api->data);
-    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, payload);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, devnull);
-    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, RPS_CURL_UA);
-    curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1L);
-    curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, timeout);
-    res = curl_easy_perform(curl_handle);
-
-    if(res != CURLE_OK) {
-        log_error("post upstream (%s:%d) statistic to '%s' trigger error. %s", 
-                name, rps_unresolve_port(&u->server), api->data,  curl_easy_strerror(res));
-        status = RPS_ERROR;
-    } else {
-#ifdef RPS_MORE_VERBOSE
-        log_verb("post upstream (%s:%d) statistic success", name, rps_unresolve_port(&u->server));
+    if (len == 0 || len > UPSTREAM_REVISION_MAX_LENGTH) {
+        return false;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)rev[i]) && rev[i] != '-' && rev[i] != '_' && rev[i] != '.') {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Apply a delta response in place, no temporary pool:
+ *  {"revision": "..", "full": false, "upstreams": [records], "removed": [{host, port, proto}]}
+ * Upstreams are added or changed ones. A full response lists the whole pool, unlisted
+ * upstreams are retired then. changed counts upstreams added, updated or removed.
+ */
+static rps_status_t
+upstream_pool_delta(struct upstream_pool *up, json_t *root, uint32_t *changed) {
+    json_t *revision, *full, *ups, *removed, *element;
+    struct upstream u, *pu;
+    struct hashmap_entry *e, *next;
+    char u_key[UPSTREAM_KEY_MAX_LENGTH];
+    size_t key_size, val_size;
+    void *ov;
+    uint32_t i, n;
+    rps_status_t status;
+
+    revision = json_object_get(root, "revision");
+    full = json_object_get(root, "full");
+    ups = json_object_get(root, "upstreams");
+    removed = json_object_get(root, "removed");
+
+    if (!json_is_string(revision) || (ups != NULL && !json_is_array(ups)) ||
+            (removed != NULL && !json_is_array(removed))) {
+        log_error("json invalid delta, want revision, upstreams and removed");
+        return RPS_ERROR;
+    }
+
+    if (!upstream_revision_valid(json_string_value(revision), json_string_length(revision))) {
+        log_error("json invalid delta revision '%s'", json_string_value(revision));
+        return RPS_ERROR;
+    }
+
+    n = 0;
+
+    if (json_is_true(full)) {
+        up->sweep++;
+    }
+
+    for (i = 0; ups != NULL && i < json_array_size(ups); i++) {
+        element = json_array_get(ups, i);
+        upstream_init(&u);
+        u.proto = up->proto;
+        if (upstream_json_parse(&u, element) == RPS_OK) {
+            if ((pu = upstream_pool_apply(up, &u)) == NULL) {
+                upstream_deinit(&u);
+                return RPS_ENOMEM;
+            }
+            pu->seen = up->sweep;
+            n++;
+        }
+        upstream_deinit(&u);
+    }
+
+    for (i = 0; removed != NULL && i < json_array_size(removed); i++) {
+        element = json_array_get(removed, i);
+        upstream_init(&u);
+        u.proto = up->proto;
+        if (upstream_json_parse(&u, element) == RPS_OK) {
+            key_size = upstream_key(&u, u_key, UPSTREAM_KEY_MAX_LENGTH);
+            ov = hashmap_get(&up->pool, u_key, key_size, &val_size);
+            if (ov != NULL) {
+                status = upstream_pool_retire(up, (struct upstream *)*(void **)ov, 
+                        u_key, key_size);
+                if (status != RPS_OK) {
+                    upstream_deinit(&u);
+                    return status;
+                }
+                n++;
+            }
+        }
+        upstream_deinit(&u);
+    }
+
+    if (json_is_true(full)) {
+        for (i = 0; i < up->pool.size; i++) {
+            for (e = up->pool.buckets[i]; e != NULL; e = next) {
+                next = e->next;
+                pu = (struct upstream *)*(void **)e->value;
+                if (pu->seen == up->sweep) {
+                    continue;
+                }
+                if (upstream_pool_retire(up, pu, e->key, e->key_size) != RPS_OK) {
+                    return RPS_ENOMEM;
+                }
+                n++;
+            }
+        }
+    }
+
+    /* without one the next refresh asks for the whole pool */
+    string_deinit(&up->revision);
+    if (string_duplicate(&up->revision, json_string_value(revision), 
+                json_string_length(revision)) != RPS_OK) {
+        log_error("save %s upstreams revision failed", rps_proto_str(up->proto));
+    }
+
+    *changed = n;
+
+    return RPS_OK;
+}
+
+/* Legacy apis answer the whole pool as an array, merged without removing */
+static rps_status_t
+upstream_pool_load(struct upstream_pool *up, const char *resp, uint32_t *changed) {
+    json_t *root;
+    json_error_t error;
+    rps_hashmap_t new_pool;
+    rps_status_t status;
+
+    root = json_loads(resp, 0, &error);
+    if (!root) {
+        log_error("json decode upstream pool error: %s", error.text);
+        return RPS_ERROR;
+    }
+
+    if (json_typeof(root) == JSON_OBJECT) {
+        status = upstream_pool_delta(up, root, changed);
+        json_decref(root);
+        return status;
+    }
+
+    if (json_typeof(root) != JSON_ARRAY) {
+        log_error("json invalid records,  response should be array or delta");
+        json_decref(root);
+        return RPS_ERROR;
+    }
+
+    string_deinit(&up->revision);
+
+    status = hashmap_init(&new_pool, UPSTREAM_DEFAULT_POOL_LENGTH, HASHMAP_DEFAULT_COLLISIONS);
+    if (status == RPS_OK) {
+        upstream_pool_json_parse(&new_pool, root);
+        status = upstream_pool_merge(up, &new_pool);
+        *changed = hashmap_n(&new_pool);
+
+        hashmap_foreach2(&new_pool, (hashmap_foreach2_t)upstream_pool_deinit_foreach);
+        hashmap_deinit(&new_pool);
+    }
+
+    json_decref(root);
+
+    return status;
+}
+
+/*
+ * Unlink expired upstream proxy from the pool, it leaves the next snapshot.
+ * Memory is recycled by upstream_pool_reclaim once no reader nor session uses it.
+ */
+static uint32_t
+upstream_pool_cleanup(struct upstream_pool *up) {
+    uint32_t i, n;
+    rps_ts_t now;
+    struct hashmap_entry *e, *next;
+    struct upstream *u;
+    struct upstream_counter c;
+    char name[MAX_HOSTNAME_LEN];
+
+    now = rps_now();
+    n = 0;
+
+    for (i = 0; i < up->pool.size; i++) {
+        for (e = up->pool.buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            u = (struct upstream *)*(void **)e->value;
+
+            /* unset expire date parameter */
+            if (u->expire_date == 0) {
+                continue;
+            }
+
+            if (u->expire_date > now) {
+                continue;
+            }
+
+#ifdef RPS_UPSTREAM_DELAY_CLEANUP
+            if (u->enable) {
+                continue;
+            }
 #endif
-        status = RPS_OK;
+            rps_unresolve_addr(&u->server, name);
+            upstream_counters(u, &c);
+            log_verb("%s:%d be cleanup, expire_date:%ld, now:%ld (s:%d, f:%d, c:%d)",
+                    name, rps_unresolve_port(&u->server), u->expire_date, now,
+                    c.success, c.failure, c.count);
+
+            if (upstream_pool_retire(up, u, e->key, e->key_size) == RPS_OK) {
+                n++;
+            }
+        }
+    }
+
+    return n;
+}
+
+/* Called after a grace period, free retired upstreams no session is using any more */
+static void
+upstream_pool_reclaim(struct upstream_pool *up) {
+    uint32_t i;
+    struct upstream **retired;
+    struct upstream *u;
+    struct upstream_counter c;
+
+    i = 0;
+    while (i < array_n(&up->retired)) {
+        retired = (struct upstream **)array_get(&up->retired, i);
+        u = *retired;
+
+        /* still be using, a balanced count also needs the marking that balanced it done */
+        upstream_counters(u, &c);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ((c.success + c.failure) != c.count || 
+                __atomic_load_n(&u->marks, __ATOMIC_ACQUIRE) != 0 ||
+                __atomic_load_n(&u->probes, __ATOMIC_ACQUIRE) != 0 ||
+                __atomic_load_n(&u->dirty, __ATOMIC_ACQUIRE) != 0) {
+            i++;
+            continue;
+        }
+
+        upstream_deinit(u);
+        rps_free(u);
+
+        /* move the last one in */
+        *retired = *(struct upstream **)array_pop(&up->retired);
+    }
+}
+
+static uint32_t
+upstream_gcd(uint32_t a, uint32_t b) {
+    uint32_t t;
+
+    while (b != 0) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+/* Weight of an upstream within a round of at most UPSTREAM_WRR_MAX_ROUND picks */
+static uint32_t
+upstream_wrr_weight(struct upstream *u, uint32_t total, uint32_t gcd) {
+    uint64_t w;
+
+    if (!u->enable || u->weight == 0) {
+        return 0;
+    }
+
+    if (total / gcd <= UPSTREAM_WRR_MAX_ROUND) {
+        return u->weight / gcd;
+    }
+
+    w = (uint64_t)u->weight * UPSTREAM_WRR_MAX_ROUND / total;
+
+    return w > 0 ? (uint32_t)w : 1;
+}
+
+static int
+upstream_wrr_cmp(const void *a, const void *b) {
+    double va, vb;
+
+    va = ((const struct upstream *)a)->vt;
+    vb = ((const struct upstream *)b)->vt;
+
+    return va < vb ? -1 : (va > vb ? 1 : 0);
+}
+
+/*
+ * Smooth weighted round robin by virtual time, computed once per refresh instead of an
+ * O(n) scan per pick. Upstream i is due every 1/w_i of virtual time and the round takes
+ * the earliest due one until the round's unit of virtual time passed. Equal due times
+ * go in heap order, the sequence is spread like nginx's but not the same. Virtual times
+ * are kept in the upstreams, so a new round goes on where the last one stopped and a
+ * weight change does not restart anyone.
+ */
+static rps_status_t
+upstream_wrr_round(struct upstream_snapshot *ss) {
+    rps_heap_t heap;
+    struct upstream *u;
+    uint32_t i, w, n, total, gcd;
+    double stride;
+
+    total = 0;
+    gcd = 0;
+
+    for (i = 0; i < ss->n; i++) {
+        u = ss->ups[i];
+        if (!u->enable || u->weight == 0) {
+            continue;
+        }
+        total += u->weight;
+        gcd = upstream_gcd(u->weight, gcd);
+    }
+
+    if (total == 0) {
+        return RPS_OK;
+    }
+
+    n = 0;
+    for (i = 0; i < ss->n; i++) {
+        n += upstream_wrr_weight(ss->ups[i], total, gcd);
+    }
+
+    ss->round = rps_alloc(n * sizeof(struct upstream *));
+    if (ss->round == NULL) {
+        return RPS_ENOMEM;
+    }
+
+    if (heap_init(&heap, ss->n, upstream_wrr_cmp) != RPS_OK) {
+        return RPS_ENOMEM;
+    }
+
+    for (i = 0; i < ss->n; i++) {
+        u = ss->ups[i];
+        w = upstream_wrr_weight(u, total, gcd);
+        if (w == 0) {
+            continue;
+        }
+
+        stride = 1.0 / w;
+        if (u->vt < 0 || u->vt > stride) {
+            /* newcomer or weight raised */
+            u->vt = stride / 2;
+        }
+
+        heap_push(&heap, u);
+    }
+
+    n = 0;
+
+    while ((u = heap_top(&heap)) != NULL && u->vt < 1.0) {
+        ss->round[n++] = u;
+        u->vt += 1.0 / upstream_wrr_weight(u, total, gcd);
+        heap_fix_top(&heap);
+    }
+
+    /* next round starts at 0 */
+    while ((u = heap_pop(&heap)) != NULL) {
+        u->vt -= 1.0;
+    }
+
+    heap_deinit(&heap);
+
+    ss->nround = n;
+
+    return RPS_OK;
+}
+
+static int
+upstream_chash_cmp(const void *a, const void *b) {
+    uint32_t ha, hb;
+
+    ha = ((const struct upstream_point *)a)->hash;
+    hb = ((const struct upstream_point *)b)->hash;
+
+    return ha < hb ? -1 : (ha > hb ? 1 : 0);
+}
+
+/*
+ * Hash ring of the snapshot. Points derive from the upstream key only, an upstream
+ * joining or leaving moves just the keys between its points and their predecessors.
+ * Disabled upstreams keep their points and are passed over at pick time.
+ */
+static rps_status_t
+upstream_chash_ring(struct upstream_snapshot *ss) {
+    struct upstream *u;
+    struct upstream_point *p;
+    char key[UPSTREAM_KEY_MAX_LENGTH + 16];
+    uint32_t i, j, n, vnodes, weights;
+    uint64_t base;
+    int len;
+
+    weights = 0;
+    for (i = 0; i < ss->n; i++) {
+        weights += ss->ups[i]->weight;
+    }
+
+    if (weights == 0) {
+        return RPS_OK;
+    }
+
+    /* vnodes of an upstream = base * weight / UPSTREAM_DEFAULT_WEIGHT */
+    base = UPSTREAM_CHASH_VNODES;
+    if (base * weights / UPSTREAM_DEFAULT_WEIGHT > UPSTREAM_CHASH_MAX_POINTS) {
+        base = (uint64_t)UPSTREAM_CHASH_MAX_POINTS * UPSTREAM_DEFAULT_WEIGHT / weights;
+    }
+
+    n = 0;
+    for (i = 0; i < ss->n; i++) {
+        u = ss->ups[i];
+        if (u->weight > 0) {
+            n += MAX(1, base * u->weight / UPSTREAM_DEFAULT_WEIGHT);
+        }
+    }
+
+    ss->ring = rps_alloc(n * sizeof(struct upstream_point));
+    if (ss->ring == NULL) {
+        return RPS_ENOMEM;
+    }
+
+    p = ss->ring;
+
+    for (i = 0; i < ss->n; i++) {
+        u = ss->ups[i];
+        if (u->weight == 0) {
+            continue;
+        }
+
+        vnodes = MAX(1, base * u->weight / UPSTREAM_DEFAULT_WEIGHT);
+        len = upstream_key(u, key, UPSTREAM_KEY_MAX_LENGTH);
+
+        for (j = 0; j < vnodes; j++) {
+            snprintf(key + len, 16, "#%u", j);
+            MurmurHash3_x86_32(key, strlen(key), 0, &p->hash);
+            p->u = u;
+            p++;
+        }
+    }
+
+    qsort(ss->ring, n, sizeof(struct upstream_point), upstream_chash_cmp);
+
+    ss->npoints = n;
+
+    return RPS_OK;
+}
+
+static struct upstream_snapshot *
+upstream_snapshot_create(rps_hashmap_t *pool, uint8_t schedule) {
+    struct upstream_snapshot *ss;
+    struct hashmap_entry *e;
+    uint32_t i;
+
+    ss = rps_alloc(sizeof(*ss) + hashmap_n(pool) * sizeof(struct upstream *));
+    if (ss == NULL) {
+        return NULL;
+    }
+
+    ss->n = 0;
+    ss->nround = 0;
+    ss->round = NULL;
+    ss->npoints = 0;
+    ss->ring = NULL;
+    ss->nready = 0;
+
+    /* filled by upstream_pool_publish */
+    ss->ready = rps_calloc(MAX(hashmap_n(pool), 1), sizeof(struct upstream *));
+    if (ss->ready == NULL) {
+        upstream_snapshot_destroy(ss);
+        return NULL;
+    }
+
+    for (i = 0; i < pool->size; i++) {
+        for (e = pool->buckets[i]; e != NULL; e = e->next) {
+            ss->ups[ss->n++] = (struct upstream *)*(void **)e->value;
+        }
+    }
+
+    if (schedule == up_wrr && upstream_wrr_round(ss) != RPS_OK) {
+        upstream_snapshot_destroy(ss);
+        return NULL;
+    }
+
+    if (schedule == up_chash && upstream_chash_ring(ss) != RPS_OK) {
+        upstream_snapshot_destroy(ss);
+        return NULL;
+    }
+
+    return ss;
+}
+
+/* Reader slot of the calling thread, taken on first use */
+static struct upstream_reader *
+upstreams_reader(struct upstreams *us) {
+    uint32_t i;
+
+    if (upstream_reader != NULL) {
+        return upstream_reader;
+    }
+
+    i = __atomic_fetch_add(&us->nreaders, 1, __ATOMIC_RELAXED);
+    if (i >= UPSTREAM_MAX_READERS) {
+        log_error("too many upstream readers, max %d", UPSTREAM_MAX_READERS);
+        return NULL;
+    }
+
+    upstream_reader = &us->readers[i];
+
+    return upstream_reader;
+}
+
+static void
+upstreams_read_lock(struct upstreams *us, struct upstream_reader *r) {
+    __atomic_store_n(&r->epoch, __atomic_load_n(&us->epoch, __ATOMIC_ACQUIRE),
+            __ATOMIC_SEQ_CST);
+    /* epoch must be visible before any snapshot pointer is loaded */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void
+upstreams_read_unlock(struct upstream_reader *r) {
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Return once no reader can hold anything unpublished before the call */
+static void
+upstreams_synchronize(struct upstreams *us) {
+    uint64_t epoch, e;
+    uint32_t i, n;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    epoch = __atomic_add_fetch(&us->epoch, 1, __ATOMIC_SEQ_CST);
+
+    n = MIN(__atomic_load_n(&us->nreaders, __ATOMIC_ACQUIRE), UPSTREAM_MAX_READERS);
+
+    for (i = 0; i < n; i++) {
+        for (;;) {
+            e = __atomic_load_n(&us->readers[i].epoch, __ATOMIC_ACQUIRE);
+            if (e == 0 || e >= epoch) {
+                break;
+            }
+            usleep(UPSTREAM_GRACE_WAIT);
+        }
+    }
+}
+
+static void
+upstream_pool_dirty_all(struct upstream_pool *up) {
+    struct hashmap_entry *e;
+    uint32_t i;
+
+    for (i = 0; i < up->pool.size; i++) {
+        for (e = up->pool.buckets[i]; e != NULL; e = e->next) {
+            upstream_dirty((struct upstream *)*(void **)e->value);
+        }
+    }
+}
+
+static void
+upstream_on_stats(void *data, rps_status_t status, long code, const char *resp, size_t len) {
+    struct upstream_pool *up;
+
+    UNUSED(code);
+    UNUSED(resp);
+    UNUSED(len);
+
+    up = data;
+    up->posting--;
+
+    if (status != RPS_OK) {
+        /* upstreams of the batch count as sent, records are absolute, send all again */
+        upstream_pool_dirty_all(up);
+    }
+}
+
+/* Take the dirty list of the round, O(changed). Records point at their upstreams */
+static void
+upstream_pool_collect(struct upstream_pool *up) {
+    struct upstream *u, *next;
+    struct upstream_stat *st;
+    uint32_t gen;
+
+    /* changes from now on queue in the next round */
+    gen = __atomic_add_fetch(&up->gen, 1, __ATOMIC_RELAXED);
+    if (gen == 0) {
+        __atomic_store_n(&up->gen, 1, __ATOMIC_RELAXED);
+    }
+
+    u = __atomic_exchange_n(&up->dirty, NULL, __ATOMIC_ACQUIRE);
+
+    for (; u != NULL; u = next) {
+        next = u->dirty_next;
+        __atomic_store_n(&u->dirty, 0, __ATOMIC_SEQ_CST);
+
+        st = (struct upstream_stat *)array_push(&up->stats);
+        if (st == NULL) {
+            upstream_dirty(u);
+            continue;
+        }
+
+        st->u = u;
+        upstream_counters(u, &st->c);
+        st->timewheel = rate_day_n(&u->rate);
+        st->enable = u->enable;
+    }
+}
+
+/* Append s as json string, dst has room for 6 bytes per byte of s */
+static size_t
+upstream_json_str(char *dst, rps_str_t *s) {
+    static const char hex[] = "0123456789abcdef";
+    uint8_t ch;
+    size_t i, n;
+
+    if (s->data == NULL) {
+        memcpy(dst, "null", 4);
+        return 4;
+    }
+
+    n = 0;
+    dst[n++] = '"';
+
+    for (i = 0; i < s->len; i++) {
+        ch = s->data[i];
+        if (ch == '"' || ch == '\\') {
+            dst[n++] = '\\';
+            dst[n++] = ch;
+        } else if (ch < 0x20) {
+            memcpy(&dst[n], "\\u00", 4);
+            n += 4;
+            dst[n++] = hex[ch >> 4];
+            dst[n++] = hex[ch & 0xf];
+        } else {
+            dst[n++] = ch;
+        }
+    }
+
+    dst[n++] = '"';
+
+    return n;
+}
+
+/* Write records as a json array into the pool's payload buffer, grown as needed */
+static rps_status_t
+upstream_stats_write(struct upstream_pool *up, struct upstream_stat *st, uint32_t n) {
+    char name[MAX_HOSTNAME_LEN];
+    struct upstream *u;
+    size_t size, len;
+    uint32_t i;
+    char *p;
+
+    size = 3;
+    for (i = 0; i < n; i++) {
+        u = st[i].u;
+        size += UPSTREAM_STAT_MAX_LENGTH + 6 * (u->uname.len + u->passwd.len + u->source.len);
+    }
+
+    if (size > up->payload_size) {
+        p = rps_realloc(up->payload, size);
+        if (p == NULL) {
+            return RPS_ENOMEM;
+        }
+        up->payload = p;
+        up->payload_size = size;
+    }
+
+    p = up->payload;
+    len = 0;
+    p[len++] = '[';
+
+    for (i = 0; i < n; i++) {
+        u = st[i].u;
+        rps_unresolve_addr(&u->server, name);
+
+        len += sprintf(&p[len], "%s{\"host\":\"%s\",\"port\":%d,\"uname\":", 
+                i > 0 ? "," : "", name, rps_unresolve_port(&u->server));
+        len += upstream_json_str(&p[len], &u->uname);
+        len += sprintf(&p[len], ",\"passwd\":");
+        len += upstream_json_str(&p[len], &u->passwd);
+        len += sprintf(&p[len], ",\"source\":");
+        len += upstream_json_str(&p[len], &u->source);
+        len += sprintf(&p[len], ",\"success\":%u,\"failure\":%u,\"count\":%u,"
+                "\"insert_date\":%ld,\"expire_date\":%ld,\"enable\":%d,\"timewheel\":%u}",
+                st[i].c.success, st[i].c.failure, st[i].c.count, 
+                (long int)u->insert_date, (long int)u->expire_date, st[i].enable, st[i].timewheel);
+    }
+
+    p[len++] = ']';
+    p[len] = '\0';
+
+    return RPS_OK;
+}
+
+static rps_status_t
+upstream_stats_commit(struct upstream_pool *up, struct upstream_stat *st, uint32_t n) {
+    rps_status_t status;
+
+    status = upstream_stats_write(up, st, n);
+    if (status == RPS_OK) {
+        status = api_post(&up->upstreams->api, (const char *)up->stats_api.data, 
+                "application/json", up->payload, up->timeout, upstream_on_stats, up);
+    }
+
+    if (status != RPS_OK) {
+        log_error("post %d %s upstream statistic to '%s' failed", 
+                n, rps_proto_str(up->proto), up->stats_api.data);
+        return status;
     }
-    
-    curl_easy_cleanup(curl_handle);
-    fclose(devnull);
-    return status;
+
+    up->posting++;
+
+    return RPS_OK;
 }
 
+/* Post upstreams changed since their last commit, in batches over kept alive connections */
 static void
 upstream_pool_stats(struct upstream_pool *up) {
-    struct hashmap_entry *entry;
-    struct upstream *upstream;
-    struct upstream *t_upstream;
-    uint32_t i;
-    rps_array_t t_pool;
+    struct upstream_stat *st;
+    uint32_t i, n, total;
 
-    if (hashmap_n(&up->pool) == 0) {
+    if (up->posting > 0) {
+        log_warn("%s upstream statistic still posting %d batches, skip this round", 
+                rps_proto_str(up->proto), up->posting);
         return;
     }
 
-    /* hashmap is non thread safe
-     * copy the upstream pool in temporary array, avoid memory race condition 
-     */
-    uv_rwlock_rdlock(&up->rwlock);
-    array_init(&t_pool, hashmap_n(&up->pool), sizeof(struct upstream));
-    for (i = 0; i < up->pool.size; i++) {
-        entry = up->pool.buckets[i];
-        while (entry != NULL) {
-            upstream = (struct upstream *)*(void **)entry->value;
-            t_upstream = (struct upstream *)array_push(&t_pool);
-            upstream_init(t_upstream);
-            upstream_copy(t_upstream, upstream);
-            entry = entry->next;
+    upstream_pool_collect(up);
+
+    total = array_n(&up->stats);
+
+    for (i = 0; i < total; i += n) {
+        st = (struct upstream_stat *)array_get(&up->stats, i);
+        n = MIN(total - i, UPSTREAM_STATS_BATCH);
+
+        if (upstream_stats_commit(up, st, n) != RPS_OK) {
+            /* the rest keep their place in the next round */
+            for (; i < total; i++) {
+                st = (struct upstream_stat *)array_get(&up->stats, i);
+                upstream_dirty(st->u);
+            }
+            break;
+        }
+    }
+
+    /* reused by the next round */
+    while (array_n(&up->stats)) {
+        array_pop(&up->stats);
+    }
+
+    log_debug("commit %s upstream pool, %d of <%d> proxys changed", 
+            rps_proto_str(up->proto), total, hashmap_n(&up->pool));
+}
+
+/*
+ * Fill the ready set of a new snapshot and swap it in, returns the old one. Membership
+ * moves over under the pool's lock, updates never land in a set that is not current.
+ */
+static struct upstream_snapshot *
+upstream_pool_publish(struct upstream_pool *up, struct upstream_snapshot *ss) {
+    struct upstream_snapshot *old;
+    struct upstream *u;
+    uint64_t now;
+    uint32_t i;
+
+    now = uv_hrtime() / 1000000;
+
+    upstream_spin_lock(&up->lock);
+
+    old = up->snapshot;
+    if (old != NULL) {
+        for (i = 0; i < old->n; i++) {
+            __atomic_store_n(&old->ups[i]->ready, UPSTREAM_NOT_READY, __ATOMIC_RELAXED);
         }
     }
-    uv_rwlock_rdunlock(&up->rwlock);
 
-    while (array_n(&t_pool)) {
-        t_upstream = (struct upstream *)array_pop(&t_pool);
-        upstream_stats_commit(t_upstream, &up->stats_api, up->timeout);
-        upstream_deinit(t_upstream);
+    /* rebuilt from the new members, retired ones drop out */
+    while (heap_pop(&up->sleeping) != NULL) {
+        /* void */
+    }
+
+    for (i = 0; i < ss->n; i++) {
+        u = ss->ups[i];
+
+        if (!u->enable || u->parked) {
+            u->wake = 0;
+            continue;
+        }
+
+        if (u->wake > now && heap_push(&up->sleeping, u) == RPS_OK) {
+            continue;
+        }
+
+        u->wake = 0;
+        upstream_ready_add(ss, u);
     }
 
-    array_deinit(&t_pool);
+    upstream_pool_sleeping_update(up);
+
+    __atomic_store_n(&up->snapshot, ss, __ATOMIC_SEQ_CST);
+
+    upstream_spin_unlock(&up->lock);
+
+    return old;
 }
 
+/*
+ * Publish the next snapshot once membership or weights changed and free what
+ * no one uses. An unchanged pool keeps its snapshot, expired ones still go.
+ * Retired upstreams are reclaimed only once a snapshot without them is published.
+ */
 static rps_status_t
-upstream_pool_refresh(struct upstream_pool *up) {
-    rps_hashmap_t new_pool;
+upstream_pool_update(struct upstreams *us, struct upstream_pool *up, uint32_t changed) {
+    struct upstream_snapshot *ss, *old;
 
-    /* Free current upstream pool only when new pool load successful */
+    changed += upstream_pool_cleanup(up);
 
-    if (hashmap_init(&new_pool, UPSTREAM_DEFAULT_POOL_LENGTH, HASHMAP_DEFAULT_COLLISIONS) != RPS_OK) {
-        return RPS_ERROR;
+    if (changed == 0 && !up->unpublished && up->snapshot != NULL) {
+        upstream_pool_reclaim(up);
+        return RPS_OK;
     }
 
-    if (upstream_pool_load(&new_pool, &up->api, up->timeout) != RPS_OK) {
-        hashmap_foreach2(&new_pool, (hashmap_foreach2_t)upstream_pool_deinit_foreach);
-        hashmap_deinit(&new_pool);
-        log_error("load %s upstreams from webapi failed.", rps_proto_str(up->proto));
-        return RPS_ERROR;
+    ss = upstream_snapshot_create(&up->pool, us->schedule);
+    if (ss == NULL) {
+        /* keep the old snapshot, retired ones wait for the next refresh */
+        log_error("alloc %s upstream snapshot failed", rps_proto_str(up->proto));
+        return RPS_ENOMEM;
     }
 
-    uv_rwlock_wrlock(&up->rwlock);
-    upstream_pool_merge(&up->pool, &new_pool);
-    upstream_pool_cleanup(&up->pool);
-    uv_rwlock_wrunlock(&up->rwlock);
-    
-    hashmap_foreach2(&new_pool, (hashmap_foreach2_t)upstream_pool_deinit_foreach);
-    hashmap_deinit(&new_pool);
-    
+    old = upstream_pool_publish(up, ss);
+    up->unpublished = 0;
+
+    upstreams_synchronize(us);
+
+    if (old != NULL) {
+        upstream_snapshot_destroy(old);
+    }
+    upstream_pool_reclaim(up);
 
     #ifdef RPS_MORE_VERBOSE
         upstream_pool_dump(up);
@@ -786,98 +1834,351 @@ upstream_pool_refresh(struct upstream_pool *up) {
     return RPS_OK;
 }
 
-void
-upstreams_refresh(uv_timer_t *handle) {
+/* Servers wait until every pool has had its first load, loaded or not */
+static void
+upstream_pool_loaded(struct upstream_pool *up) {
     struct upstreams *us;
+
+    us = up->upstreams;
+
+    if (up->once) {
+        return;
+    }
+
+    up->once = 1;
+
+    if (--us->pending > 0) {
+        return;
+    }
+
+    uv_mutex_lock(&us->mutex);
+    us->once = 1;
+    uv_cond_broadcast(&us->ready);
+    uv_mutex_unlock(&us->mutex);
+}
+
+static void
+upstream_pool_on_load(void *data, rps_status_t status, long code, const char *resp, size_t len) {
     struct upstream_pool *up;
-    int i, len;
     const char *proto;
+    uint32_t changed;
 
-    us = (struct upstreams *)handle->data;
+    up = data;
+    up->loading = 0;
 
-    len = array_n(&us->pools);
+    proto = rps_proto_str(up->proto);
+    changed = 0;
 
-    for (i=0; i< len; i++) {
-        up = (struct upstream_pool *)array_get(&us->pools, i);
+    /* Keep current upstream pool when load failed */
 
-        proto = rps_proto_str(up->proto);
+    if (status == RPS_OK && code == API_NOT_MODIFIED) {
+        log_verb("%s upstreams not modified since revision %s", proto, up->revision.data);
+    } else if (status == RPS_OK) {
+        log_verb("fetch upstreams from '%s' success, %zu bytes", up->api.data, len);
+        status = upstream_pool_load(up, resp, &changed);
+    }
 
-        if (upstream_pool_refresh(up) != RPS_OK) { 
-            log_error("update %s upstream proxy pool failed", proto) ;
-            return;
-        } else {
-            log_info("refresh %s upstream pool, get <%d> proxys", proto, hashmap_n(&up->pool));
-        }
+    if (status == RPS_OK) {
+        status = upstream_pool_update(up->upstreams, up, changed);
     }
-    
-    //run only once
-    if (us->once == 0) {
-        uv_mutex_lock(&us->mutex);
-        uv_cond_broadcast(&us->ready);
-        uv_mutex_unlock(&us->mutex);
+
+    if (status == RPS_OK) {
+        log_info("refresh %s upstream pool, %d changed, get <%d> proxys", proto, 
+                changed, hashmap_n(&up->pool));
+    } else {
+        log_error("update %s upstream proxy pool failed", proto);
     }
-    us->once = 1;
+
+    upstream_pool_loaded(up);
 }
 
-void
+static void
+upstream_pool_refresh(struct upstream_pool *up) {
+    const char *proto;
+    char url[UPSTREAM_URL_MAX_LENGTH];
+    int n;
+
+    proto = rps_proto_str(up->proto);
+
+    if (up->loading) {
+        log_warn("%s upstream pool still loading, skip this refresh", proto);
+        return;
+    }
+
+    /* revision of the pool we hold, the api answers what changed since */
+    n = snprintf(url, sizeof(url), "%s%csince=%s", up->api.data, 
+            strchr((char *)up->api.data, '?') != NULL ? '&' : '?',
+            string_empty(&up->revision) ? "" : (char *)up->revision.data);
+    if (n < 0 || (size_t)n >= sizeof(url)) {
+        log_error("%s upstreams api url too long", proto);
+        upstream_pool_loaded(up);
+        return;
+    }
+
+    if (api_get(&up->upstreams->api, url, up->timeout, 
+                upstream_pool_on_load, up) != RPS_OK) {
+        log_error("load %s upstreams from webapi failed.", proto);
+        upstream_pool_loaded(up);
+        return;
+    }
+
+    up->loading = 1;
+}
+
+/* Pools load in parallel, a slow or failing one holds no other back */
+static void
+upstreams_refresh(uv_timer_t *handle) {
+    struct upstreams *us;
+    uint32_t i;
+
+    us = (struct upstreams *)handle->data;
+
+    for (i = 0; i < array_n(&us->pools); i++) {
+        upstream_pool_refresh((struct upstream_pool *)array_get(&us->pools, i));
+    }
+}
+
+static void
 upstreams_stats(uv_timer_t *handle) {
     struct upstreams *us;
-    struct upstream_pool *up;
-    int i, len;
-    const char *proto;
+    uint32_t i;
 
     us = (struct upstreams *)handle->data;
 
-    len = array_n(&us->pools);
+    for (i = 0; i < array_n(&us->pools); i++) {
+        upstream_pool_stats((struct upstream_pool *)array_get(&us->pools, i));
+    }
+}
+
+/* Control plane, refresh and stats share one loop and its web api client */
+void
+upstreams_run(struct upstreams *us, uint32_t refresh, uint32_t stats) {
+    uint32_t i;
+
+    if (api_init(&us->api) != RPS_OK) {
+        log_error("upstreams control plane init failed");
+        /* as a failed first load, servers must not wait on it forever */
+        for (i = 0; i < array_n(&us->pools); i++) {
+            upstream_pool_loaded((struct upstream_pool *)array_get(&us->pools, i));
+        }
+        return;
+    }
+
+    uv_timer_init(&us->api.loop, &us->refresh_timer);
+    us->refresh_timer.data = us;
+    uv_timer_start(&us->refresh_timer, upstreams_refresh, 0, refresh);
 
-    for (i=0; i< len; i++) {
-        up = (struct upstream_pool *)array_get(&us->pools, i);
-        proto = rps_proto_str(up->proto);
-        upstream_pool_stats(up);
-        log_debug("commit %s upstream pool, count <%d> proxys", proto, hashmap_n(&up->pool));
+    uv_timer_init(&us->api.loop, &us->stats_timer);
+    us->stats_timer.data = us;
+    if (stats > 0) {
+        for (i = 0; i < array_n(&us->pools); i++) {
+            ((struct upstream_pool *)array_get(&us->pools, i))->tracked = 1;
+        }
+        uv_timer_start(&us->stats_timer, upstreams_stats, stats, stats);
     }
+
+    uv_run(&us->api.loop, UV_RUN_DEFAULT);
+
+    uv_close((uv_handle_t *)&us->refresh_timer, NULL);
+    uv_close((uv_handle_t *)&us->stats_timer, NULL);
+    api_deinit(&us->api);
 }
 
 static struct upstream *
-upstream_pool_get_rr(struct upstream_pool *up) {
-    struct hashmap_entry *entry;
-    struct upstream *upstream;
+upstream_pool_get_rr(struct upstreams *us, struct upstream_pool *up,
+        struct upstream_snapshot *ss, uint32_t *hash) {
+    uint32_t i, n;
 
-    entry = hashmap_next(&up->iter);
-    if (entry == NULL) {
+    UNUSED(us);
+    UNUSED(hash);
+
+    /* once, other workers may empty the set meanwhile */
+    n = upstream_ready_n(ss);
+    if (n == 0) {
         return NULL;
     }
-    upstream = (struct upstream *)*(void **)entry->value;
 
-    return upstream;
+    i = __atomic_fetch_add(&up->cursor, 1, __ATOMIC_RELAXED);
+
+    return upstream_ready_get(ss, i % n);
 }
 
 static struct upstream *
-upstream_pool_get_random(struct upstream_pool *up) {
-    struct hashmap_entry *entry;
-    struct upstream *upstream;
+upstream_pool_get_wrr(struct upstreams *us, struct upstream_pool *up,
+        struct upstream_snapshot *ss, uint32_t *hash) {
+    uint32_t i;
+
+    UNUSED(us);
+    UNUSED(hash);
 
-    entry = hashmap_get_random_entry(&up->pool);
-    if (entry == NULL) {
+    if (ss->nround == 0) {
         return NULL;
     }
-    upstream = (struct upstream *)*(void **)entry->value;
 
-    return upstream;
+    i = __atomic_fetch_add(&up->cursor, 1, __ATOMIC_RELAXED);
+
+    return ss->round[i % ss->nround];
+}
+
+/* Expected time to establish, scaled by the sessions already queued on it */
+static uint64_t
+upstream_p2c_cost(struct upstream *u) {
+    uint64_t latency;
+
+    latency = (uint64_t)__atomic_load_n(&u->connect_time, __ATOMIC_RELAXED) +
+        __atomic_load_n(&u->handshake_time, __ATOMIC_RELAXED);
+
+    return latency * (upstream_inflight(u) + 1);
+}
+
+static struct upstream *
+upstream_pool_get_p2c(struct upstreams *us, struct upstream_pool *up,
+        struct upstream_snapshot *ss, uint32_t *hash) {
+    struct upstream *a, *b;
+    uint32_t i, j, n;
+
+    UNUSED(us);
+    UNUSED(up);
+    UNUSED(hash);
+
+    n = upstream_ready_n(ss);
+    if (n == 0) {
+        return NULL;
+    }
+
+    i = rps_random(n);
+    a = upstream_ready_get(ss, i);
+
+    if (n == 1) {
+        return a;
+    }
+
+    j = rps_random(n - 1);
+    b = upstream_ready_get(ss, j >= i ? j + 1 : j);
+
+    return upstream_p2c_cost(a) <= upstream_p2c_cost(b) ? a : b;
+}
+
+/*
+ * Fewest sessions in flight per weight among a few ready upstreams, drawn at random
+ * so a pick costs the same at any pool size. Sets no larger than that are scanned
+ * whole from a rotating start so ties are spread. Saturated upstreams are passed over.
+ */
+static struct upstream *
+upstream_pool_get_least_conn(struct upstreams *us, struct upstream_pool *up,
+        struct upstream_snapshot *ss, uint32_t *hash) {
+    struct upstream *u, *best;
+    uint32_t i, k, start, n, nready, best_n, limit;
+
+    UNUSED(hash);
+
+    best = NULL;
+    best_n = 0;
+    nready = upstream_ready_n(ss);
+    if (nready == 0) {
+        return NULL;
+    }
+
+    start = __atomic_fetch_add(&up->cursor, 1, __ATOMIC_RELAXED);
+
+    for (k = 0; k < MIN(nready, UPSTREAM_LEAST_CONN_CHOICES); k++) {
+        if (nready <= UPSTREAM_LEAST_CONN_CHOICES) {
+            i = (start + k) % nready;
+        } else {
+            i = (uint32_t)rps_random(nready);
+        }
+        u = upstream_ready_get(ss, i);
+
+        if (u->weight == 0) {
+            continue;
+        }
+
+        /* counters are summed once, saturation is judged on the same sum */
+        n = upstream_inflight(u);
+        limit = u->max_inflight > 0 ? u->max_inflight : us->max_inflight;
+        if (limit > 0 && n >= limit) {
+            continue;
+        }
+
+        /* n / weight < best_n / best->weight */
+        if (best == NULL || (uint64_t)n * best->weight < (uint64_t)best_n * u->weight) {
+            best = u;
+            best_n = n;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * First ring point at or after the hash. The hash moves past the point, a retry
+ * walks on clockwise to the next one.
+ */
+static struct upstream *
+upstream_pool_get_chash(struct upstreams *us, struct upstream_pool *up,
+        struct upstream_snapshot *ss, uint32_t *hash) {
+    struct upstream_point *p;
+    uint32_t lo, hi, mid;
+
+    UNUSED(us);
+    UNUSED(up);
+
+    if (ss->npoints == 0) {
+        return NULL;
+    }
+
+    lo = 0;
+    hi = ss->npoints;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ss->ring[mid].hash < *hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    p = &ss->ring[lo % ss->npoints];
+    *hash = p->hash + 1;
+
+    return p->u;
+}
+
+static struct upstream *
+upstream_pool_get_random(struct upstreams *us, struct upstream_pool *up,
+        struct upstream_snapshot *ss, uint32_t *hash) {
+    uint32_t n;
+
+    UNUSED(us);
+    UNUSED(up);
+    UNUSED(hash);
+
+    n = upstream_ready_n(ss);
+    if (n == 0) {
+        return NULL;
+    }
+
+    return upstream_ready_get(ss, rps_random(n));
 }
 
 struct upstream *
-upstreams_get(struct upstreams *us, rps_proto_t proto) {
+upstreams_get(struct upstreams *us, rps_proto_t proto, const void *key, size_t len) {
     struct upstream *upstream;
     struct upstream_pool *up;
-    int i, len;
-    int count;
+    struct upstream_snapshot *ss;
+    struct upstream_reader *reader;
+    int i, n;
+    int count, skip;
+    uint32_t hash;
+    uint64_t now, wake;
     upstream_pool_get_algorithm get_func;
 
     upstream = NULL;
     up = NULL;
     get_func = NULL;
     count = 0;
+    skip = 0;
 
     if (us->hybrid) {
         if (proto == HTTP_TUNNEL || proto == SOCKS5) {
@@ -892,8 +2193,8 @@ upstreams_get(struct upstreams *us, rps_proto_t proto) {
             up = array_random(&us->pools);
         }
     } else {
-        len = array_n(&us->pools);
-        for (i=0; i<len; i++) {
+        n = array_n(&us->pools);
+        for (i=0; i<n; i++) {
             up = array_get(&us->pools, i);
             if (up->proto == proto) {
                 break;
@@ -909,42 +2210,86 @@ upstreams_get(struct upstreams *us, rps_proto_t proto) {
             get_func = upstream_pool_get_random;
             break;
         case up_wrr:
+            get_func = upstream_pool_get_wrr;
+            break;
+        case up_p2c:
+            get_func = upstream_pool_get_p2c;
+            break;
+        case up_least_conn:
+            get_func = upstream_pool_get_least_conn;
+            break;
+        case up_chash:
+            get_func = upstream_pool_get_chash;
+            break;
         default:
             NOT_REACHED();
     }   
 
-    uv_rwlock_rdlock(&up->rwlock);
+    if (key != NULL && len > 0) {
+        MurmurHash3_x86_32(key, (int)len, 0, &hash);
+    } else {
+        hash = (uint32_t)rps_random(INT32_MAX);
+    }
+
+    reader = upstreams_reader(us);
+    if (reader == NULL) {
+        return NULL;
+    }
+
+    upstreams_read_lock(us, reader);
+
+    ss = __atomic_load_n(&up->snapshot, __ATOMIC_ACQUIRE);
+
+    now = uv_hrtime() / 1000000;
+
+    wake = __atomic_load_n(&up->wake, __ATOMIC_ACQUIRE);
+    if (wake > 0 && now >= wake) {
+        upstream_pool_wake(up, now);
+    }
 
+    /* 
+     * Tripped and throttled ones leave the ready set as they are found, those
+     * are not counted. Fails once the set is empty or the loop keeps missing.
+     */
     for ( ; ; ) {
-        if (count >= UPSTREAM_MAX_LOOP) {
+        if (ss == NULL || upstream_ready_n(ss) == 0 || count >= UPSTREAM_MAX_LOOP) {
             upstream = NULL;
             break;
         }
 
-        upstream = get_func(up);
-
-        count += 1;
+        upstream = get_func(us, up, ss, &hash);
 
         if (upstream == NULL) {
             break;
         }
 
-        if (!upstream->enable) {
+        if (!upstream_is_ready(upstream)) {
+            /* wrr round and chash ring keep all, or a slot changed under us */
+            count += 1;
+            if (++skip >= UPSTREAM_MAX_SKIP) {
+                get_func = upstream_pool_get_random;
+            }
             continue;
         }
 
-        if (upstream_poor_quality(upstream, us->max_fail_rate)) {
-            upstream->enable = 0;
+        /* soft cap, workers may pass it at once */
+        if (upstream_saturated(upstream, us->max_inflight)) {
+            count += 1;
             continue;
         }
 
-        if (upstream_freshly(upstream)) {
-            upstream_init_timewheel(upstream, us->mr1m, us->mr1h, us->mr1d);
-            break;
+        /* ones that could not leave the set count, or an all throttled pool spins */
+        if (!upstream_breaker_allow(upstream, us, now, &wake)) {
+            if (!upstream_pool_throttle(up, upstream, wake)) {
+                count += 1;
+            }
+            continue;
         }
 
-        if (upstream_request_too_often(upstream, us->mr1m, us->mr1h, us->mr1d)) {
-            upstream = NULL;
+        if (!upstream_admit(upstream, us, now, &wake)) {
+            if (!upstream_pool_throttle(up, upstream, wake)) {
+                count += 1;
+            }
             continue;
         }
 
@@ -958,12 +2303,111 @@ upstreams_get(struct upstreams *us, rps_proto_t proto) {
 #endif
     
     if (upstream != NULL) {
-        upstream->count += 1;    
-        if (us->mr1m > 0 || us->mr1h > 0 || us->mr1d >0) {
-            upstream_timewheel_add(upstream);
-        }
+        __atomic_add_fetch(&upstream_shard_get(upstream)->count, 1, __ATOMIC_RELAXED);
     }
     
-    uv_rwlock_rdunlock(&up->rwlock);
+    upstreams_read_unlock(reader);
     return upstream;
 }
+
+/*
+ * Hold the enabled upstreams of a pool's current snapshot, until their probes are done.
+ * On error nothing is held and ups is left empty.
+ */
+rps_status_t
+upstreams_hold(struct upstreams *us, struct upstream_pool *up, rps_array_t *ups) {
+    struct upstream_reader *reader;
+    struct upstream_snapshot *ss;
+    struct upstream **p;
+    rps_status_t status;
+    uint32_t i;
+
+    reader = upstreams_reader(us);
+    if (reader == NULL) {
+        return RPS_ERROR;
+    }
+
+    status = RPS_OK;
+
+    upstreams_read_lock(us, reader);
+
+    ss = __atomic_load_n(&up->snapshot, __ATOMIC_ACQUIRE);
+
+    for (i = 0; ss != NULL && i < ss->n; i++) {
+        if (!ss->ups[i]->enable) {
+            continue;
+        }
+
+        p = (struct upstream **)array_push(ups);
+        if (p == NULL) {
+            status = RPS_ENOMEM;
+            break;
+        }
+
+        *p = ss->ups[i];
+        /* seen by reclaim, it waits for this epoch */
+        __atomic_add_fetch(&ss->ups[i]->probes, 1, __ATOMIC_SEQ_CST);
+    }
+
+    if (status != RPS_OK) {
+        while (array_n(ups)) {
+            upstreams_unhold(*(struct upstream **)array_pop(ups));
+        }
+    }
+
+    upstreams_read_unlock(reader);
+
+    return status;
+}
+
+/* Drop the hold of a probe never sent, the last touch of u */
+void
+upstreams_unhold(struct upstream *u) {
+    __atomic_sub_fetch(&u->probes, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Health probe outcome from the checker thread, latencies were measured along the way.
+ * A passed probe closes the breaker and brings a parked upstream back, a failed one 
+ * trips and parks it.
+ */
+void
+upstreams_probe_done(struct upstreams *us, struct upstream_pool *up, 
+        struct upstream *u, bool ok) {
+    struct upstream_counter c;
+    uint64_t now, wake;
+    bool trip;
+
+    now = uv_hrtime() / 1000000;
+    trip = false;
+
+    upstream_counters(u, &c);
+
+    upstream_spin_lock(&u->lock);
+    if (ok && u->breaker != up_closed) {
+        upstream_breaker_close(u, &c, now);
+    } else if (!ok && u->breaker != up_open) {
+        upstream_breaker_open(u, us->probed, now, &wake);
+        trip = true;
+    }
+    upstream_spin_unlock(&u->lock);
+
+    if (ok) {
+        upstream_spin_lock(&up->lock);
+        if (u->parked) {
+            u->parked = 0;
+            /* a retired one is in no current snapshot */
+            if (u->enable && !u->retired) {
+                upstream_ready_add(up->snapshot, u);
+            }
+        }
+        upstream_spin_unlock(&up->lock);
+    } else {
+        upstream_ewma(&u->handshake_time, UPSTREAM_FAIL_PENALTY);
+        if (trip) {
+            upstream_pool_throttle(up, u, wake);
+        }
+    }
+
+    upstreams_unhold(u);
+}
@@ -8,30 +8,101 @@
 #include "hashmap.h"
 #include "_string.h"
 #include "config.h"
+#include "rate.h"
+#include "heap.h"
+#include "api.h"
 
 #include <uv.h>
 
 #define UPSTREAM_DEFAULT_WEIGHT 10
 #define UPSTREAM_DEFAULT_POOL_LENGTH 10000
-#define UPSTREAM_DEFAULT_TIME_WHEEL_LENGTH 1000
 #define UPSTREAM_DEFAULT_SCHEDULE up_rr
 
-#define UPSTREAM_MIN_FAILURE   10
+#define UPSTREAM_MIN_FAILURE   10   /* in the breaker window, before max_fail_rate applies */
 #define UPSTREAM_MAX_LOOP      100
+#define UPSTREAM_MAX_SKIP      8    /* out of ready set picks of wrr, chash before drawing randomly */
+#define UPSTREAM_LEAST_CONN_CHOICES 8  /* ready upstreams a least_conn pick compares */
+#define UPSTREAM_NOT_READY     UINT32_MAX
 
 #define UPSTREAM_KEY_MAX_LENGTH 128
-#define UPSTREAM_PAYLOAD_MAX_LENGTH 512
+
+/* Delta refresh, the api's pool revision is echoed back as since=<revision> */
+#define UPSTREAM_REVISION_MAX_LENGTH  64
+#define UPSTREAM_URL_MAX_LENGTH       1024
+
+/* Upstreams per stats request, as a json array */
+#define UPSTREAM_STATS_BATCH    1000
+#define UPSTREAM_STAT_MAX_LENGTH  (MAX_HOSTNAME_LEN + 256)  /* json of a record, but strings */
+
+/* Threads scheduling upstreams, each takes a reader slot on its first upstreams_get */
+#define UPSTREAM_MAX_READERS    256
+#define UPSTREAM_GRACE_WAIT     100 //us, between scans of readers still in old epoch
+
+/* Counter blocks per upstream, threads are spread over them */
+#define UPSTREAM_SHARDS         8
+
+/* Picks in one wrr round, weights are scaled down beyond */
+#define UPSTREAM_WRR_MAX_ROUND  65536
+
+/* Ring points of an upstream with default weight, total points are capped */
+#define UPSTREAM_CHASH_VNODES       100
+#define UPSTREAM_CHASH_MAX_POINTS   (1 << 20)
+
+/* Latency EWMA weight of a new sample is 1/2^UPSTREAM_EWMA_SHIFT */
+#define UPSTREAM_EWMA_SHIFT     3
+#define UPSTREAM_FAIL_PENALTY   5000000 //us, latency sample of a failed attempt
+
+/* 
+ * Circuit breaker. Fail rate counts the last one to two windows, a tripped upstream
+ * sleeps for the open time doubled by each trip in a row, then a few trial sessions
+ * decide whether it closes or opens again.
+ * With health checks a tripped upstream is parked instead, until a probe passes.
+ */
+#define UPSTREAM_BREAKER_WINDOW     10000   //ms
+#define UPSTREAM_BREAKER_OPEN       1000    //ms, of the first trip
+#define UPSTREAM_BREAKER_MAX_TRIPS  6       //open time stops doubling beyond
+#define UPSTREAM_BREAKER_TRIALS     3       //half-open sessions
+#define UPSTREAM_BREAKER_PROBE      200     //ms, half-open waits for trials in flight
+
+enum upstream_breaker {
+    up_closed,     /* scheduled as usual */
+    up_open,       /* tripped, sleeps out of the ready set */
+    up_half_open,  /* trial sessions only */
+};
 
 enum upstream_schedule {
     up_rr,         /* round-robin */
     up_wrr,        /* weighted round-robin*/
     up_random,     /* raondom schedule */
+    up_p2c,        /* power of two choices, by latency and load */
+    up_least_conn, /* fewest sessions in flight per weight */
+    up_chash,      /* consistent hash, sticky per key */
+};
+
+enum upstream_hash_key {
+    up_hash_client,    /* client ip */
+    up_hash_remote,    /* target host */
+    up_hash_session,   /* token of username 'user-session-<token>', client ip without */
 };
 
 /*
  * upstreams.pools -> {2-3}upstream_pool.pool -> {n}upstream
  */
 
+/* Counters bumped by the threads of one shard, a cache line each */
+struct upstream_shard {
+    uint32_t    success;
+    uint32_t    failure;
+    uint32_t    count;
+    uint8_t     pad[52];
+};
+
+struct upstream_counter {
+    uint32_t    success;
+    uint32_t    failure;
+    uint32_t    count;
+};
+
 struct upstream  {
     rps_addr_t  server;
     rps_proto_t proto;
@@ -40,6 +111,10 @@ struct upstream  {
     rps_str_t   source;
 
     uint16_t    weight;
+    uint32_t    max_inflight;   /* sessions at once, 0 takes upstreams' default */
+    double      vt;     /* wrr virtual time of its next pick, refresh only */
+
+    /* Base values, written by refresh only. Live counters add up the shards */
     uint32_t    success;
     uint32_t    failure;
     uint32_t    count;
@@ -47,23 +122,105 @@ struct upstream  {
     rps_ts_t    insert_date;
     rps_ts_t    expire_date;
 
-    /* The time wheel which be used to control the QPS
-     * The element storaged in queue are long int expressed timestamp, 
-     * 4 bytes in 32bit platform, 8 bytes in 64 bits which exactly the pointer length on various platform.
-     */
-    rps_queue_t timewheel;
+    /* Latency EWMAs in us, 0 until measured */
+    uint32_t    connect_time;   /* tcp connect */
+    uint32_t    handshake_time; /* connected to established */
+
+    /* Requests of recent windows, control the QPS */
+    struct rate rate;
+    uint32_t    lock;   /* spin lock of rate and breaker */
+
+    /* Breaker, outcomes are live counters less the bases */
+    uint8_t     breaker;
+    uint8_t     trips;  /* opens in a row */
+    uint64_t    since;  /* ms, current window or half-open began. 0 before the first check */
+    struct upstream_counter base;   /* as of since */
+    struct upstream_counter prev;   /* as of the window before */
+
+    /* Ready set membership, changed under the pool's lock */
+    uint32_t    ready;  /* slot in current snapshot's ready set, UPSTREAM_NOT_READY if out */
+    uint64_t    wake;   /* throttled until, ms. 0 if not */
+    uint8_t     parked; /* out of the ready set until a health probe passes */
+    uint8_t     retired;
+
+    uint32_t    probes; /* health probes holding it */
+    uint32_t    marks;  /* outcomes being marked, touching it past the balanced count */
+
+    /* Stats, on its pool's dirty list once changed since the last commit */
+    struct upstream_pool *pool;
+    struct upstream *dirty_next;
+    uint32_t    dirty;  /* stats round it changed in, 0 if clean */
+    uint32_t    seen;   /* full delta sweep it was last listed in */
     
     uint8_t     enable:1;
+
+    struct upstream_shard shards[UPSTREAM_SHARDS];
+};
+
+/*
+ * Immutable, densely packed view of a pool. Refresh publishes a new one with an atomic
+ * pointer swap and frees the old one after every reader left the epoch it was read in,
+ * scheduling takes no lock.
+ *
+ * Only the ready set changes, it holds the enabled and not throttled upstreams in
+ * its first nready slots. Updates take the pool's lock and swap the last one into
+ * the leaving slot, readers load slots without lock and check membership of the pick.
+ */
+struct upstream_point {
+    uint32_t                hash;
+    struct upstream         *u;
+};
+
+struct upstream_snapshot {
+    uint32_t                n;
+    uint32_t                npoints;
+    struct upstream_point   *ring;      /* chash points sorted by hash */
+    uint32_t                nround;
+    struct upstream         **round;    /* wrr picks in order, tail of ups */
+    uint32_t                nready;
+    struct upstream         **ready;
+    struct upstream         *ups[];
+};
+
+/* Changed upstream of a stats round, strings stay in the upstream */
+struct upstream_stat {
+    struct upstream         *u;
+    struct upstream_counter c;
+    uint32_t                timewheel;
+    uint8_t                 enable;
+};
+
+/* Epoch the reader entered, 0 while outside upstreams_get. One cache line each */
+struct upstream_reader {
+    uint64_t                epoch;
+    uint8_t                 pad[56];
 };
 
 struct upstream_pool {
-    rps_hashmap_t           pool;
-    rps_hashmap_iterator_t  iter;
+    struct upstreams        *upstreams;
+    rps_hashmap_t           pool;     /* owned by the control loop */
+    struct upstream_snapshot *snapshot;
+    uint32_t                cursor;   /* (weighted) round robin over snapshot */
+    rps_array_t             retired;  /* unpublished upstreams, freed once unused */
+    uint8_t                 unpublished; /* retired ones may be in the live snapshot */
     rps_proto_t             proto;
     rps_str_t               api;
     rps_str_t               stats_api;
     uint32_t                timeout; //api request max timeout
-    uv_rwlock_t             rwlock;
+    uint8_t                 loading;  /* refresh request in flight */
+    uint8_t                 once;     /* first load finished */
+    rps_str_t               revision; /* of the api's pool merged last, empty before */
+    uint32_t                sweep;    /* full delta responses merged */
+    uint32_t                posting;  /* stats requests in flight */
+    struct upstream         *dirty;   /* changed since the last commit, pushed lock free */
+    uint32_t                gen;      /* stats round */
+    uint8_t                 tracked;  /* stats on, changes are queued */
+    rps_array_t             stats;    /* records of a round, reused */
+    char                    *payload; /* of a batch, reused */
+    size_t                  payload_size;
+    uint32_t                lock;     /* spin lock of ready set and sleeping */
+    rps_heap_t              sleeping; /* throttled upstreams, earliest wake first */
+    uint64_t                wake;     /* wake of sleeping top, ms. 0 if empty */
 };
 
 struct upstreams {
@@ -71,11 +228,19 @@ struct upstreams {
     bool                    hybrid;
     uint16_t                maxreconn;
     uint16_t                maxretry;
-    uint32_t                mr1m;
-    uint32_t                mr1h;
-    uint32_t                mr1d;
+    struct rate_limit       limit;
     float                   max_fail_rate;
+    uint32_t                max_inflight;   /* 0 means no limits */
+    uint8_t                 hash_key;
+    bool                    probed;     /* health checked, probes revive tripped upstreams */
     rps_array_t             pools;
+    uint64_t                epoch;
+    uint32_t                nreaders;
+    struct upstream_reader  readers[UPSTREAM_MAX_READERS];
+    struct api              api;        /* of the control loop, refresh and stats */
+    uv_timer_t              refresh_timer;
+    uv_timer_t              stats_timer;
+    uint32_t                pending;    /* pools yet to finish their first load */
     uv_cond_t               ready;
     uv_mutex_t              mutex;
     uint8_t                 once:1;
@@ -83,12 +248,21 @@ struct upstreams {
 
 void upstream_init(struct upstream *u);
 void upstream_deinit(struct upstream *u);
+void upstream_counters(struct upstream *u, struct upstream_counter *c);
+void upstream_mark_success(struct upstream *u);
+void upstream_mark_failure(struct upstream *u);
+void upstream_mark_connect(struct upstream *u, uint64_t usec);
+void upstream_mark_established(struct upstream *u, uint64_t usec);
 
 rps_status_t upstreams_init(struct upstreams *us, 
         struct config_api *api, struct config_upstreams *cu);
-struct upstream  *upstreams_get(struct upstreams *us, rps_proto_t proto);
+struct upstream  *upstreams_get(struct upstreams *us, rps_proto_t proto,
+        const void *key, size_t len);
 void upstreams_deinit(struct upstreams *us);
-void upstreams_refresh(uv_timer_t *handle);
-void upstreams_stats(uv_timer_t *handler);
+void upstreams_run(struct upstreams *us, uint32_t refresh, uint32_t stats);
+rps_status_t upstreams_hold(struct upstreams *us, struct upstream_pool *up, rps_array_t *ups);
+void upstreams_unhold(struct upstream *u);
+void upstreams_probe_done(struct upstreams *us, struct upstream_pool *up, 
+        struct upstream *u, bool ok);
 
 #endif
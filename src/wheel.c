@@ -0,0 +1,118 @@
+#include "core.h"
+#include "wheel.h"
+#include "util.h"
+
+static void
+wheel_link(struct wheel_node *head, struct wheel_node *node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void
+wheel_unlink(struct wheel_node *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+static void
+wheel_insert(struct wheel *wh, struct wheel_node *node) {
+    uint64_t tick;
+
+    tick = (node->active + node->timeout + WHEEL_TICK - 1) / WHEEL_TICK;
+    if (tick < wh->tick) {
+        /* already due, expire on next tick */
+        tick = wh->tick;
+    }
+
+    wheel_link(&wh->slots[tick % WHEEL_SLOTS], node);
+}
+
+static void
+wheel_on_tick(uv_timer_t *handle) {
+    struct wheel *wh;
+    struct wheel_node *slot, *node;
+    struct wheel_node pending;
+    uint64_t now, end;
+
+    wh = handle->data;
+
+    now = uv_now(wh->loop);
+    end = now / WHEEL_TICK;
+
+    /* loop stalled, one round visits every slot */
+    if (end >= wh->tick + WHEEL_SLOTS) {
+        wh->tick = end - WHEEL_SLOTS + 1;
+    }
+
+    for (; wh->tick <= end; wh->tick++) {
+        slot = &wh->slots[wh->tick % WHEEL_SLOTS];
+        if (slot->next == slot) {
+            continue;
+        }
+
+        /* move the slot aside, expire callbacks may add or delete any node */
+        pending.next = slot->next;
+        pending.prev = slot->prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        slot->next = slot;
+        slot->prev = slot;
+
+        while (pending.next != &pending) {
+            node = pending.next;
+            wheel_unlink(node);
+
+            if (node->active + node->timeout > now) {
+                /* touched since hashed, not due yet */
+                wheel_insert(wh, node);
+                continue;
+            }
+
+            wh->n--;
+            wh->expire(node);
+        }
+    }
+}
+
+void
+wheel_init(struct wheel *wh, uv_loop_t *loop, wheel_expire_t expire) {
+    uint32_t i;
+
+    for (i = 0; i < WHEEL_SLOTS; i++) {
+        wh->slots[i].prev = &wh->slots[i];
+        wh->slots[i].next = &wh->slots[i];
+    }
+
+    wh->loop = loop;
+    wh->tick = uv_now(loop) / WHEEL_TICK;
+    wh->n = 0;
+    wh->expire = expire;
+
+    uv_timer_init(loop, &wh->timer);
+    wh->timer.data = wh;
+    uv_timer_start(&wh->timer, wheel_on_tick, WHEEL_TICK, WHEEL_TICK);
+    uv_unref((uv_handle_t *)&wh->timer);
+}
+
+/* Arm node, expire once timeout ms passed since node->active */
+void
+wheel_add(struct wheel *wh, struct wheel_node *node) {
+    ASSERT(!wheel_armed(node));
+
+    wheel_insert(wh, node);
+    wh->n++;
+}
+
+void
+wheel_del(struct wheel *wh, struct wheel_node *node) {
+    if (!wheel_armed(node)) {
+        return;
+    }
+
+    wheel_unlink(node);
+    wh->n--;
+}
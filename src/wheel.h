@@ -0,0 +1,61 @@
+/*
+ * Hashed timing wheel with coarse ticks, one per event loop.
+ *
+ * A node expires once timeout ms passed since its last activity. Activity only updates
+ * a field, nodes are re-hashed lazily when their slot comes round and they are not
+ * due yet. Expired nodes are unlinked before the expire callback, re-add to re-arm.
+ */
+
+#ifndef _RPS_WHEEL_H
+#define _RPS_WHEEL_H
+
+#include <uv.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define WHEEL_TICK      1000 //ms
+#define WHEEL_SLOTS     64
+
+struct wheel_node {
+    struct wheel_node   *prev;
+    struct wheel_node   *next;
+    uint64_t            active;     /* last activity, loop time in ms */
+    uint64_t            timeout;    /* ms */
+    void                *data;
+};
+
+typedef void (*wheel_expire_t)(struct wheel_node *);
+
+struct wheel {
+    uv_timer_t          timer;
+    uv_loop_t           *loop;
+    struct wheel_node   slots[WHEEL_SLOTS];
+    uint64_t            tick;       /* next tick to process */
+    uint32_t            n;          /* armed nodes */
+    wheel_expire_t      expire;
+};
+
+static inline void
+wheel_node_init(struct wheel_node *node, uint64_t timeout, void *data) {
+    node->prev = NULL;
+    node->next = NULL;
+    node->active = 0;
+    node->timeout = timeout;
+    node->data = data;
+}
+
+static inline bool
+wheel_armed(struct wheel_node *node) {
+    return node->next != NULL;
+}
+
+static inline void
+wheel_touch(struct wheel *wh, struct wheel_node *node) {
+    node->active = uv_now(wh->loop);
+}
+
+void wheel_init(struct wheel *wh, uv_loop_t *loop, wheel_expire_t expire);
+void wheel_add(struct wheel *wh, struct wheel_node *node);
+void wheel_del(struct wheel *wh, struct wheel_node *node);
+
+#endif